@@ -1,13 +1,14 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a set of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 // 
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
-// * After changing buffer data, call bwrite to write it to disk.
+// * After changing buffer data, call bwrite to write it to disk,
+//     or bwritestart and later bwait to overlap several writes.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
@@ -19,43 +20,201 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+//
+// Buffers are found through a hash table on (dev, blockno) with
+// one lock per bucket, so lookups of different blocks do not
+// contend.  A bucket's lock protects its chain and the B_BUSY
+// flag of the buffers on it.  All buffers are also on one LRU
+// list, under its own lock, which brelse() updates and which is
+// searched for a buffer to recycle on a miss.  Only one CPU at a
+// time recycles buffers (bcache.evict), so a block cannot be
+// given two buffers.  Locks are taken in the order evict,
+// bucket, lru, and at most one bucket lock is held at a time.
+//
+// Buffers come from a slab cache.  The cache starts with NBUF
+// buffers and adds one on a miss, rather than recycling, while
+// it is under BCACHEPCT percent of physical memory and more than
+// BCACHEMINFREE pages are free.  When user memory runs out,
+// ualloc() calls bshrink() to give pages back before it swaps,
+// down to NBUF, which leaves room for the two transactions the
+// log may pin (B_DIRTY) and for read-ahead.  bshrink() frees the
+// clean buffers of one slab page at a time, bypassing the
+// per-CPU stacks, so that the page itself is released.  Should every buffer
+// still be busy or pinned, bget() allocates one past the limits,
+// or as a last resort waits for a brelse().
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
 #include "spinlock.h"
+#include "memlayout.h"
+#include "mmu.h"
 #include "fs.h"
 #include "buf.h"
 
-struct {
+#define NBUCKET 61
+#define MAXBUF  (PHYSTOP / 100 * BCACHEPCT / sizeof(struct buf))
+#define HASH(dev, blockno) (((uint)(dev) * 31 + (uint)(blockno)) % NBUCKET)
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;  // chain through hnext
+};
+
+struct {
+  struct spinlock evict;
+  struct spinlock lru;
+  struct kmcache *cache;
+  uint nbuf;  // buffers allocated; changed under evict
+  uint nahead;  // read-ahead requests in flight; under lru
+  uint nrelse;  // brelse() calls, so bget() can wait for one; under lru
+  int waiting;  // bget() is waiting for a brelse(); under lru
+  struct bucket bucket[NBUCKET];
 
   // Linked list of all buffers, through prev/next.
   // head.next is most recently used.
   struct buf head;
 } bcache;
 
+// Allocate a new buffer and put it on the LRU list, not on
+// any hash chain.  Returns 0 if out of memory.
+static struct buf*
+bnew(void)
+{
+  struct buf *b;
+
+  if((b = kmcache_allocdirect(bcache.cache)) == 0)
+    return 0;
+  b->flags = 0;
+  b->dev = -1;
+  b->blockno = 0;
+  b->hnext = 0;
+  b->qnext = 0;
+  b->done = 0;
+  acquire(&bcache.lru);
+  b->next = bcache.head.next;
+  b->prev = &bcache.head;
+  bcache.head.next->prev = b;
+  bcache.head.next = b;
+  release(&bcache.lru);
+  bcache.nbuf++;
+  return b;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *bk;
+  int i;
 
-  initlock(&bcache.lock, "bcache");
+  initlock(&bcache.evict, "bcache.evict");
+  initlock(&bcache.lru, "bcache.lru");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    initlock(&bk->lock, "bcache.bucket");
+  bcache.cache = kmcache_create("buf", sizeof(struct buf), 0);
 
 //PAGEBREAK!
   // Create linked list of buffers
   bcache.head.prev = &bcache.head;
   bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    b->dev = -1;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  for(i = 0; i < NBUF; i++){
+    if((b = bnew()) == 0)
+      panic("binit");
+    bk = &bcache.bucket[HASH(b->dev, b->blockno)];
+    b->hnext = bk->head;
+    bk->head = b;
+  }
+}
+
+// Find the least recently used buffer that is neither busy nor
+// dirty, and on slab page page unless that is 0, take it off its
+// hash chain and mark it B_BUSY.
+// Returns 0 if every such buffer is busy or dirty.
+// Caller holds bcache.evict, which keeps dev and blockno of
+// every buffer from changing.
+static struct buf*
+bclaim(char *page)
+{
+  struct buf *b, **pp;
+  struct bucket *bk;
+
+  for(;;){
+    // "clean" because B_DIRTY and !B_BUSY means log.c
+    // hasn't yet committed the changes to the buffer.
+    acquire(&bcache.lru);
+    for(b = bcache.head.prev; b != &bcache.head; b = b->prev)
+      if((b->flags & (B_BUSY|B_DIRTY)) == 0 &&
+         (page == 0 || (char*)PGROUNDDOWN((uint)b) == page))
+        break;
+    release(&bcache.lru);
+    if(b == &bcache.head)
+      return 0;
+
+    // The flags were read without the bucket lock; check again.
+    bk = &bcache.bucket[HASH(b->dev, b->blockno)];
+    acquire(&bk->lock);
+    if((b->flags & (B_BUSY|B_DIRTY)) == 0){
+      for(pp = &bk->head; *pp != b; pp = &(*pp)->hnext)
+        ;
+      *pp = b->hnext;
+      b->flags = B_BUSY;
+      release(&bk->lock);
+      return b;
+    }
+    release(&bk->lock);
   }
 }
 
+// Get a B_BUSY buffer to hold a block that is not cached:
+// a new one if the cache may grow, else a recycled one.
+// Returns 0 if every buffer is in use.
+// Caller holds bcache.evict.
+static struct buf*
+bvictim(void)
+{
+  struct buf *b;
+
+  if(bcache.nbuf < MAXBUF && kfreecount() > BCACHEMINFREE &&
+     (b = bnew()) != 0){
+    b->flags = B_BUSY;
+    return b;
+  }
+  return bclaim(0);
+}
+
+// Give memory back to the kernel, keeping at least NBUF
+// buffers.  Frees every clean buffer on the slab page of the
+// least recently used one, which releases the page unless one
+// of its buffers is busy or dirty; then tries the next page
+// if need be.  Returns the number of pages released.
+int
+bshrink(void)
+{
+  struct buf *b;
+  uint pages;
+  char *page;
+
+  acquire(&bcache.evict);
+  pages = kmcache_pages(bcache.cache);
+  while(bcache.nbuf > NBUF && kmcache_pages(bcache.cache) == pages){
+    if((b = bclaim(0)) == 0)
+      break;
+    page = (char*)PGROUNDDOWN((uint)b);
+    do {
+      acquire(&bcache.lru);
+      b->next->prev = b->prev;
+      b->prev->next = b->next;
+      release(&bcache.lru);
+      kmcache_freedirect(bcache.cache, b);
+      bcache.nbuf--;
+    } while(bcache.nbuf > NBUF && (b = bclaim(page)) != 0);
+  }
+  pages -= kmcache_pages(bcache.cache);
+  release(&bcache.evict);
+  return pages;
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return B_BUSY buffer.
@@ -63,36 +222,64 @@ static struct buf*
 bget(uint dev, uint blockno)
 {
   struct buf *b;
+  struct bucket *bk;
+  uint nrelse;
 
-  acquire(&bcache.lock);
+  bk = &bcache.bucket[HASH(dev, blockno)];
+  acquire(&bk->lock);
 
  loop:
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = bk->head; b; b = b->hnext){
     if(b->dev == dev && b->blockno == blockno){
       if(!(b->flags & B_BUSY)){
         b->flags |= B_BUSY;
-        release(&bcache.lock);
+        release(&bk->lock);
         return b;
       }
-      sleep(b, &bcache.lock);
+      sleep(b, &bk->lock);
       goto loop;
     }
   }
+  release(&bk->lock);
 
-  // Not cached; recycle some non-busy and clean buffer.
-  // "clean" because B_DIRTY and !B_BUSY means log.c
-  // hasn't yet committed the changes to the buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if((b->flags & B_BUSY) == 0 && (b->flags & B_DIRTY) == 0){
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = B_BUSY;
-      release(&bcache.lock);
-      return b;
+  // Not cached.  Look again holding bcache.evict, in case
+  // another CPU brought the block in meanwhile.
+  acquire(&bcache.evict);
+  acquire(&bk->lock);
+  for(b = bk->head; b; b = b->hnext){
+    if(b->dev == dev && b->blockno == blockno){
+      release(&bcache.evict);
+      goto loop;
+    }
+  }
+  release(&bk->lock);
+
+  acquire(&bcache.lru);
+  nrelse = bcache.nrelse;
+  release(&bcache.lru);
+  if((b = bvictim()) == 0 && (b = bnew()) != 0)
+    b->flags = B_BUSY;  // all busy or pinned by the log: grow anyway
+  if(b == 0){
+    // Not even memory for one more: wait for a brelse().
+    release(&bcache.evict);
+    acquire(&bcache.lru);
+    if(bcache.nrelse == nrelse){
+      bcache.waiting = 1;
+      sleep(&bcache.nrelse, &bcache.lru);
     }
+    release(&bcache.lru);
+    acquire(&bk->lock);
+    goto loop;
   }
-  panic("bget: no buffers");
+  b->dev = dev;
+  b->blockno = blockno;
+  acquire(&bk->lock);
+  b->hnext = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  release(&bcache.evict);
+  return b;
 }
 
 // Return a B_BUSY buf with the contents of the indicated block.
@@ -108,14 +295,108 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Completion of a read-ahead: nobody is waiting for it.
+static void
+readaheaddone(struct buf *b)
+{
+  acquire(&bcache.lru);
+  bcache.nahead--;
+  release(&bcache.lru);
+  brelse(b);
+}
+
+// Start reading a block into the cache, unless it is cached
+// already or too many buffers are busy, and return without
+// waiting.  The buffer is released when the read is done.
+// Read-ahead may hold at most half of the
+// buffers, so bget() always finds one.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct buf *b;
+  struct bucket *bk;
+  int ok;
+
+  bk = &bcache.bucket[HASH(dev, blockno)];
+  acquire(&bk->lock);
+  for(b = bk->head; b; b = b->hnext)
+    if(b->dev == dev && b->blockno == blockno)
+      break;
+  release(&bk->lock);
+  if(b)
+    return;
+
+  acquire(&bcache.lru);
+  if((ok = bcache.nahead < bcache.nbuf/2) != 0)
+    bcache.nahead++;
+  release(&bcache.lru);
+  if(!ok)
+    return;
+
+  acquire(&bcache.evict);
+  acquire(&bk->lock);
+  for(b = bk->head; b; b = b->hnext)
+    if(b->dev == dev && b->blockno == blockno)
+      break;
+  release(&bk->lock);
+  if(b || (b = bvictim()) == 0){
+    release(&bcache.evict);
+    acquire(&bcache.lru);
+    bcache.nahead--;
+    release(&bcache.lru);
+    return;
+  }
+  b->dev = dev;
+  b->blockno = blockno;
+  acquire(&bk->lock);
+  b->hnext = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  release(&bcache.evict);
+
+  b->done = readaheaddone;
+  idesubmit(b);
+}
+
 // Write b's contents to disk.  Must be B_BUSY.
 void
 bwrite(struct buf *b)
+{
+  bwritestart(b);
+  bwait(b);
+}
+
+// Start writing b's contents to disk and return at once.
+// b must stay B_BUSY until bwait(b) returns.
+void
+bwritestart(struct buf *b)
 {
   if((b->flags & B_BUSY) == 0)
     panic("bwrite");
   b->flags |= B_DIRTY;
-  iderw(b);
+  idesubmit(b);
+}
+
+// Wait for a write started by bwritestart() to finish.
+void
+bwait(struct buf *b)
+{
+  ideawait(b);
+}
+
+// Between bplug() and bunplug(), writes started with
+// bwritestart() wait in the disk queue, so that writes to
+// consecutive blocks go to the disk as one transfer.
+void
+bplug(void)
+{
+  ideplug();
+}
+
+void
+bunplug(void)
+{
+  ideunplug();
 }
 
 // Release a B_BUSY buffer.
@@ -123,22 +404,31 @@ bwrite(struct buf *b)
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if((b->flags & B_BUSY) == 0)
     panic("brelse");
 
-  acquire(&bcache.lock);
+  bk = &bcache.bucket[HASH(b->dev, b->blockno)];
+  acquire(&bk->lock);
+  b->flags &= ~B_BUSY;
+  wakeup(b);
 
+  acquire(&bcache.lru);
   b->next->prev = b->prev;
   b->prev->next = b->next;
   b->next = bcache.head.next;
   b->prev = &bcache.head;
   bcache.head.next->prev = b;
   bcache.head.next = b;
+  bcache.nrelse++;
+  if(bcache.waiting){
+    bcache.waiting = 0;
+    wakeup(&bcache.nrelse);
+  }
+  release(&bcache.lru);
 
-  b->flags &= ~B_BUSY;
-  wakeup(b);
-
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 //PAGEBREAK!
 // Blank page.
@@ -4,7 +4,10 @@ struct buf {
   uint blockno;
   struct buf *prev; // LRU cache list
   struct buf *next;
+  struct buf *hnext; // hash chain
   struct buf *qnext; // disk queue
+  uint qtime;        // ticks when queued, for iosched.c
+  void (*done)(struct buf*); // if set, called when I/O completes
   uchar data[BSIZE];
 };
 #define B_BUSY  0x1  // buffer is locked by some process
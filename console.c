@@ -427,6 +427,10 @@ consoleintr(int (*getc)(void))
   release(&cons.lock);
   if(doprocdump) {
     procdump();  // now call procdump() wo. cons.lock held
+    kmemdump();
+    slabdump();
+    swapdump();
+    ioscheddump();
   }
 }
 
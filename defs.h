@@ -2,9 +2,14 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmcache;
+struct pcidev;
+struct vma;
 struct pipe;
 struct proc;
 struct rtcdate;
+struct shmseg;
+struct spawnact;
 struct spinlock;
 struct stat;
 struct superblock;
@@ -14,8 +19,14 @@ struct superblock;
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+void            breadahead(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritestart(struct buf*);
+void            bwait(struct buf*);
+void            bplug(void);
+void            bunplug(void);
+int             bshrink(void);
 
 // console.c
 void            consoleinit(void);
@@ -26,6 +37,8 @@ int             history(char *, int );
 
 // exec.c
 int             exec(char*, char**);
+int             loadimage(char*, char**, pde_t**, uint*, uint*, uint*);
+char*           progname(char*);
 
 // file.c
 struct file*    filealloc(void);
@@ -36,12 +49,20 @@ int             fileread(struct file*, char*, int n);
 int             filestat(struct file*, struct stat*);
 int             filewrite(struct file*, char*, int n);
 
+// fpu.c
+void            fpuinit(void);
+int             fputrap(void);
+void            fpusave(void);
+void            fpufork(struct proc*, struct proc*);
+void            fpureset(void);
+
 // fs.c
 void            readsb(int dev, struct superblock *sb);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+void            icacheinit(void);
 void            iinit(int dev);
 void            ilock(struct inode*);
 void            iput(struct inode*);
@@ -52,13 +73,29 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, char*, uint, uint);
+void            readahead(struct inode*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, char*, uint, uint);
 
+// futex.c
+void            futexinit(void);
+int             futexwait(uint, uint);
+int             futexwake(uint, int);
+
 // ide.c
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
+void            idesubmit(struct buf*);
+void            ideawait(struct buf*);
+void            ideplug(void);
+void            ideunplug(void);
+
+// iosched.c
+void            ioschedadd(struct buf**, struct buf*);
+struct buf*     ioschednext(struct buf**);
+void            ioscheddone(struct buf*);
+void            ioscheddump(void);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -67,9 +104,17 @@ void            ioapicinit(void);
 
 // kalloc.c
 char*           kalloc(void);
+char*           kallocpages(int);
+void            kdup(char*);
+void            kput(char*);
 void            kfree(char*);
+void            kfreepages(char*, int);
+uint            kfreecount(void);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+void            kmemdump(void);
+char*           kzalloc(void);
+void            kzerofill(void);
 
 // kbd.c
 void            kbdintr(void);
@@ -79,6 +124,7 @@ void            cmostime(struct rtcdate *r);
 int             cpunum(void);
 extern volatile uint*    lapic;
 void            lapiceoi(void);
+void            lapicipi(int, int);
 void            lapicinit(void);
 void            lapicstartap(uchar, uint);
 void            microdelay(int);
@@ -89,17 +135,37 @@ void            log_write(struct buf*);
 void            begin_op();
 void            end_op();
 
+// mmap.c
+int             mmap(uint, int, int, struct file*, uint);
+struct vma*     vmaalloc(uint);
+int             munmap(uint, uint);
+struct vma*     vmalookup(struct proc*, uint);
+uint            vmalow(struct proc*);
+void            vmaexit(struct proc*);
+int             vmacopy(struct proc*, struct proc*);
+int             vmafault(uint);
+int             vmaprefault(uint, uint, int);
+int             vmafetchstr(uint, char**);
+
 // mp.c
 extern int      ismp;
 int             mpbcpu(void);
 void            mpinit(void);
 void            mpstartthem(void);
 
+// pci.c
+void            pciinit(void);
+struct pcidev*  pcifind(int, int, int, int);
+uint            pciread(struct pcidev*, int);
+void            pciwrite(struct pcidev*, int, uint);
+void            pcienable(struct pcidev*);
+
 // picirq.c
 void            picenable(int);
 void            picinit(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, char*, int);
@@ -107,9 +173,19 @@ int             pipewrite(struct pipe*, char*, int);
 
 //PAGEBREAK: 16
 // proc.c
+char*           clockvictim(uint);
+int             clone(void (*)(void*), void*, void*);
+int             join(void**);
+void            killthreads(void);
+struct proc*    kthreadcreate(void (*)(void*), void*, char*);
+void            lockvm(void);
+void            unlockvm(void);
+void            pinuser(uint, uint);
+void            unpinuser(void);
 struct proc*    copyproc(struct proc*);
 void            exit(void);
 int             fork(void);
+int             spawn(char*, char**, struct spawnact*, int);
 int             growproc(int);
 int             kill(int);
 void            pinit(void);
@@ -121,12 +197,34 @@ void            userinit(void);
 int             wait(void);
 int             wait2(int*, int*, int*);
 void            wakeup(void*);
+int             wakeupn(void*, int);
 void            yield(void);
 int             set_prio(int);
 
 // swtch.S
 void            swtch(struct context**, struct context*);
 
+// shm.c
+void            shminit(void);
+int             shmget(char*, uint);
+int             shmat(int);
+int             shmdt(uint);
+void            shmunmap(pde_t*, struct vma*);
+void            shmdup(struct shmseg*);
+void            shmrelease(struct shmseg*);
+
+// slab.c
+void            slabinit(void);
+struct kmcache* kmcache_create(char*, uint, void (*)(void*));
+void*           kmcache_alloc(struct kmcache*);
+void            kmcache_free(struct kmcache*, void*);
+void*           kmcache_allocdirect(struct kmcache*);
+void            kmcache_freedirect(struct kmcache*, void*);
+uint            kmcache_pages(struct kmcache*);
+void*           kmalloc(uint);
+void            kmfree(void*);
+void            slabdump(void);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 void            getcallerpcs(void*, uint*);
@@ -137,6 +235,7 @@ void            pushcli(void);
 void            popcli(void);
 
 // string.c
+void            membench(void);
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
 void*           memset(void*, int, uint);
@@ -145,9 +244,20 @@ int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
 
+// swap.c
+void            swapinit(int);
+int             swapout(void);
+void            swapfree(pte_t);
+void            swapread(pte_t, char*);
+int             swapfault(uint);
+int             swapprefault(uint, uint);
+void            minorfault(void);
+char*           ualloc(void);
+void            swapdump(void);
+
 // syscall.c
 int             argint(int, int*);
-int             argptr(int, char**, int);
+int             argptr(int, char**, int, int);
 int             argstr(int, char**);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
@@ -167,6 +277,14 @@ void            uartinit(void);
 void            uartintr(void);
 void            uartputc(int);
 
+// virtio.c
+int             virtioinit(void);
+void            virtiosubmit(struct buf*);
+void            virtioawait(struct buf*);
+void            virtioplug(void);
+void            virtiounplug(void);
+int             virtiointr(int);
+
 // vm.c
 void            seginit(void);
 void            kvmalloc(void);
@@ -174,15 +292,20 @@ void            vmenable(void);
 pde_t*          setupkvm(void);
 char*           uva2ka(pde_t*, char*);
 int             allocuvm(pde_t*, uint, uint);
+int             growuvm(pde_t*, uint, uint);
 int             deallocuvm(pde_t*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
 pde_t*          copyuvm(pde_t*, uint);
 void            switchuvm(struct proc*);
+void            tlbshootdown(void);
+void            unmapfree(pde_t*, uint, char*, int);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
+pte_t*          walkpgdir(pde_t*, const void*, int);
+int             mappages(pde_t*, void*, uint, uint, int);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -2,21 +2,26 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
 #include "x86.h"
 #include "elf.h"
 
+// Build a new user address space from the ELF file at path,
+// with argv pushed on its stack.  Used by exec() and spawn().
+// Returns 0 and fills in the page table, size, initial stack
+// pointer and entry point, or returns -1.
 int
-exec(char *path, char **argv)
+loadimage(char *path, char **argv, pde_t **pgdirp, uint *szp,
+          uint *spp, uint *entryp)
 {
-  char *s, *last;
   int i, off;
   uint argc, sz, sp, ustack[3+MAXARG+1];
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
-  pde_t *pgdir, *oldpgdir;
+  pde_t *pgdir;
 
   begin_op();
   if((ip = namei(path)) == 0){
@@ -80,31 +85,64 @@ exec(char *path, char **argv)
   if(copyout(pgdir, sp, ustack, (3+argc+1)*4) < 0)
     goto bad;
 
-  // Save program name for debugging.
+  *pgdirp = pgdir;
+  *szp = sz;
+  *spp = sp;
+  *entryp = elf.entry;
+  return 0;
+
+ bad:
+  if(pgdir)
+    freevm(pgdir);
+  if(ip){
+    iunlockput(ip);
+    end_op();
+  }
+  return -1;
+}
+
+// Last path element, for the process name.
+char*
+progname(char *path)
+{
+  char *s, *last;
+
   for(last=s=path; *s; s++)
     if(*s == '/')
       last = s+1;
-  safestrcpy(proc->name, last, sizeof(proc->name));
+  return last;
+}
+
+int
+exec(char *path, char **argv)
+{
+  uint sz, sp, entry;
+  pde_t *pgdir, *oldpgdir;
+
+  if(proc->leader != proc)
+    return -1;  // only the main thread may exec
+
+  if(loadimage(path, argv, &pgdir, &sz, &sp, &entry) < 0)
+    return -1;
+
+  // Save program name for debugging.
+  safestrcpy(proc->name, progname(path), sizeof(proc->name));
 
   // Commit to the user image.
+  killthreads();
+  vmaexit(proc);
+  fpureset();
+  lockvm();
   oldpgdir = proc->pgdir;
   proc->pgdir = pgdir;
   proc->sz = sz;
-  proc->tf->eip = elf.entry;  // main
+  proc->tf->eip = entry;  // main
   proc->tf->esp = sp;
   #ifdef DML
   proc->priority = 2;
   #endif
   switchuvm(proc);
   freevm(oldpgdir);
+  unlockvm();
   return 0;
-
- bad:
-  if(pgdir)
-    freevm(pgdir);
-  if(ip){
-    iunlockput(ip);
-    end_op();
-  }
-  return -1;
 }
@@ -12,13 +12,14 @@
 struct devsw devsw[NDEV];
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kmcache *cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  ftable.cache = kmcache_create("file", sizeof(struct file), 0);
 }
 
 // Allocate a file structure.
@@ -27,16 +28,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmcache_alloc(ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -68,6 +64,7 @@ fileclose(struct file *f)
   f->ref = 0;
   f->type = FD_NONE;
   release(&ftable.lock);
+  kmcache_free(ftable.cache, f);
   
   if(ff.type == FD_PIPE)
     pipeclose(ff.pipe, ff.writable);
@@ -96,16 +93,37 @@ int
 fileread(struct file *f, char *addr, int n)
 {
   int r;
+  uint start, end;
 
   if(f->readable == 0)
     return -1;
   if(f->type == FD_PIPE)
     return piperead(f->pipe, addr, n);
   if(f->type == FD_INODE){
+    // Sequential reads double the read-ahead window, up to
+    // RAMAX blocks; any seek turns read-ahead off again.
+    if(f->off == f->ranext)
+      f->rawin = f->rawin ? f->rawin*2 : 4;
+    else
+      f->rawin = f->raend = f->ramark = 0;
+    if(f->rawin > RAMAX)
+      f->rawin = RAMAX;
     ilock(f->ip);
     if((r = readi(f->ip, addr, f->off, n)) > 0)
       f->off += r;
+    // Once reads reach the blocks of the last read-ahead,
+    // start the next: from where it ended to a window ahead.
+    if(r > 0 && f->rawin && f->off >= f->ramark){
+      start = f->raend > f->off ? f->raend : f->off;
+      end = f->off + f->rawin*BSIZE;
+      if(end > start){
+        readahead(f->ip, start, end - start);
+        f->ramark = start;
+        f->raend = end;
+      }
+    }
     iunlock(f->ip);
+    f->ranext = f->off;
     return r;
   }
   panic("fileread");
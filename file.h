@@ -6,6 +6,10 @@ struct file {
   struct pipe *pipe;
   struct inode *ip;
   uint off;
+  uint ranext;  // offset where a sequential read would start
+  uint rawin;   // read-ahead window in blocks; 0 if reads are random
+  uint raend;   // read-ahead has been started up to here
+  uint ramark;  // start more read-ahead once reads reach this
 };
 
 
@@ -15,6 +19,8 @@ struct inode {
   uint inum;          // Inode number
   int ref;            // Reference count
   int flags;          // I_BUSY, I_VALID
+  struct inode *prev; // icache list
+  struct inode *next;
 
   short type;         // copy of disk inode
   short major;
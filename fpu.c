@@ -0,0 +1,108 @@
+// x87/SSE state for user processes.
+//
+// The FPU registers are switched lazily.  Every context switch
+// leaves CR0.TS set, so a process's first FPU or SSE instruction
+// after it is scheduled raises #NM (T_DEVICE), and fputrap()
+// loads its state then.  On switch-out, sched() calls fpusave(),
+// which saves the registers only if the process used the FPU
+// in that time slice (TS is clear).  Processes that never touch
+// the FPU never pay for saving or restoring it.
+//
+// Each CPU remembers whose state its registers hold
+// (cpu->fpuowner), and each process remembers which CPU last
+// loaded its state (p->fpucpu), so a process that comes back
+// to the same CPU with nobody else having used the FPU there
+// skips the restore.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "x86.h"
+
+#define CPUID_FXSR  (1<<24)  // edx: fxsave/fxrstor, CR4.OSFXSR
+#define CPUID_SSE   (1<<25)  // edx: SSE, CR4.OSXMMEXCPT
+#define MXCSR_INIT  0x1f80   // all SIMD exceptions masked
+
+static int havefxsr;
+
+// Per-CPU setup, run by every CPU before it schedules.
+void
+fpuinit(void)
+{
+  uint eax, ebx, ecx, edx, cr4;
+
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+  if((edx & CPUID_FXSR) == 0){
+    // No fxsave: leave the FPU off; user programs that try
+    // it are killed.
+    lcr0(rcr0() | CR0_EM);
+    return;
+  }
+  havefxsr = 1;
+  cr4 = rcr4() | CR4_OSFXSR;
+  if(edx & CPUID_SSE)
+    cr4 |= CR4_OSXMMEXCPT;
+  lcr4(cr4);
+  lcr0((rcr0() & ~CR0_EM) | CR0_MP | CR0_NE | CR0_TS);
+}
+
+// Handle #NM from user space: give the FPU to the current process.
+// Returns 0, or -1 if the FPU cannot be used.
+int
+fputrap(void)
+{
+  if(!havefxsr)
+    return -1;
+  clts();
+  if(cpu->fpuowner == proc && proc->fpucpu == cpu)
+    return 0;  // registers still hold our state
+  if(proc->fpuused)
+    fxrstor(proc->fpu);
+  else {
+    fninit();
+    ldmxcsr(MXCSR_INIT);
+    proc->fpuused = 1;
+  }
+  cpu->fpuowner = proc;
+  proc->fpucpu = cpu;
+  return 0;
+}
+
+// Save the current process's FPU state if it used the FPU
+// since it was scheduled, and arrange for the next use on
+// this CPU to trap.  Interrupts must be off.
+void
+fpusave(void)
+{
+  if(rcr0() & CR0_TS)
+    return;
+  fxsave(proc->fpu);
+  lcr0(rcr0() | CR0_TS);
+}
+
+// Give child np a copy of p's FPU state.
+void
+fpufork(struct proc *np, struct proc *p)
+{
+  if(!p->fpuused)
+    return;
+  pushcli();
+  fpusave();
+  popcli();
+  memmove(np->fpu, p->fpu, sizeof(np->fpu));
+  np->fpuused = 1;
+}
+
+// Start the current process over with a clean FPU, for exec.
+void
+fpureset(void)
+{
+  pushcli();
+  lcr0(rcr0() | CR0_TS);
+  popcli();
+  proc->fpuused = 0;
+  proc->fpucpu = 0;
+}
@@ -14,8 +14,8 @@
 #include "param.h"
 #include "stat.h"
 #include "mmu.h"
-#include "proc.h"
 #include "spinlock.h"
+#include "proc.h"
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
@@ -108,6 +108,9 @@ bfree(int dev, uint b)
 // to inodes used by multiple processes. The cached
 // inodes include book-keeping information that is
 // not stored on disk: ip->ref and ip->flags.
+// Cache entries come from a slab cache and live on
+// a linked list while referenced, so the number of
+// active inodes is bounded only by memory.
 //
 // An inode and its in-memory represtative go through a
 // sequence of states before they can be used by the
@@ -118,7 +121,7 @@ bfree(int dev, uint b)
 //   the link count has fallen to zero.
 //
 // * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
+//   is freed when ip->ref drops to zero. Otherwise ip->ref tracks
 //   the number of in-memory pointers to the entry (open
 //   files and current directories). iget() to find or
 //   create a cache entry and increment its ref, iput()
@@ -156,13 +159,24 @@ bfree(int dev, uint b)
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kmcache *cache;
+
+  // Linked list of referenced inodes, through prev/next.
+  struct inode head;
 } icache;
 
 void
-iinit(int dev)
+icacheinit(void)
 {
   initlock(&icache.lock, "icache");
+  icache.cache = kmcache_create("inode", sizeof(struct inode), 0);
+  icache.head.prev = &icache.head;
+  icache.head.next = &icache.head;
+}
+
+void
+iinit(int dev)
+{
   readsb(dev, &sb);
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d inodestart %d bmap start %d\n", sb.size,
           sb.nblocks, sb.ninodes, sb.nlog, sb.logstart, sb.inodestart, sb.bmapstart);
@@ -173,22 +187,29 @@ static struct inode* iget(uint dev, uint inum);
 //PAGEBREAK!
 // Allocate a new inode with the given type on device dev.
 // A free inode has a type of zero.
+// Returns 0 if the in-memory inode cannot be allocated.
 struct inode*
 ialloc(uint dev, short type)
 {
   int inum;
   struct buf *bp;
   struct dinode *dip;
+  struct inode *ip;
 
   for(inum = 1; inum < sb.ninodes; inum++){
     bp = bread(dev, IBLOCK(inum, sb));
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
+      // Get the in-memory inode before claiming the disk one.
+      if((ip = iget(dev, inum)) == 0){
+        brelse(bp);
+        return 0;
+      }
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
       log_write(bp);   // mark it allocated on the disk
       brelse(bp);
-      return iget(dev, inum);
+      return ip;
     }
     brelse(bp);
   }
@@ -217,34 +238,36 @@ iupdate(struct inode *ip)
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
+// Returns 0 if out of memory.
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
 
   acquire(&icache.lock);
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  for(ip = icache.head.next; ip != &icache.head; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
       ip->ref++;
       release(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  // Allocate a new inode cache entry.
+  if((ip = kmcache_alloc(icache.cache)) == 0){
+    release(&icache.lock);
+    return 0;
+  }
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->flags = 0;
+  ip->next = icache.head.next;
+  ip->prev = &icache.head;
+  icache.head.next->prev = ip;
+  icache.head.next = ip;
   release(&icache.lock);
 
   return ip;
@@ -308,8 +331,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode cache entry can
-// be recycled.
+// If that was the last reference, the inode cache entry is
+// freed.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -331,7 +354,11 @@ iput(struct inode *ip)
     ip->flags = 0;
     wakeup(ip);
   }
-  ip->ref--;
+  if(--ip->ref == 0){
+    ip->next->prev = ip->prev;
+    ip->prev->next = ip->next;
+    kmcache_free(icache.cache, ip);
+  }
   release(&icache.lock);
 }
 
@@ -457,6 +484,22 @@ readi(struct inode *ip, char *dst, uint off, uint n)
   return n;
 }
 
+// Start reading the blocks holding bytes off..off+n of ip
+// into the buffer cache, without waiting for them.
+// Caller must hold ip->lock.
+void
+readahead(struct inode *ip, uint off, uint n)
+{
+  uint bn;
+
+  if(ip->type == T_DEV || off >= ip->size)
+    return;
+  if(off + n > ip->size || off + n < off)
+    n = ip->size - off;
+  for(bn = off/BSIZE; bn*BSIZE < off + n; bn++)
+    breadahead(ip->dev, bmap(ip, bn));
+}
+
 // PAGEBREAK!
 // Write data to inode.
 int
@@ -532,23 +575,23 @@ dirlookup(struct inode *dp, char *name, uint *poff)
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
-  int off;
+  int off, empty;
   struct dirent de;
-  struct inode *ip;
-
-  // Check that name is not present.
-  if((ip = dirlookup(dp, name, 0)) != 0){
-    iput(ip);
-    return -1;
-  }
 
-  // Look for an empty dirent.
+  // Check that name is not present, and look for an empty
+  // dirent.  (Not dirlookup(): its iget() can fail.)
+  empty = -1;
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlink read");
-    if(de.inum == 0)
-      break;
+    if(de.inum == 0){
+      if(empty < 0)
+        empty = off;
+    } else if(namecmp(name, de.name) == 0)
+      return -1;
   }
+  if(empty >= 0)
+    off = empty;
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
@@ -610,7 +653,9 @@ namex(char *path, int nameiparent, char *name)
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
   else
-    ip = idup(proc->cwd);
+    ip = idup(proc->leader->cwd);
+  if(ip == 0)
+    return 0;
 
   while((path = skipelem(path, name)) != 0){
     ilock(ip);
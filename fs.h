@@ -6,7 +6,7 @@
 #define BSIZE 512  // block size
 
 // Disk layout:
-// [ boot block | super block | log | inode blocks | free bit map | data blocks ]
+// [ boot block | super block | log | inode blocks | free bit map | data blocks | swap ]
 //
 // mkfs computes the super block and builds an initial file system. The super describes
 // the disk layout:
@@ -18,8 +18,12 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint swapstart;    // Block number of first swap block
+  uint nswap;        // Number of page-sized swap slots
 };
 
+#define SWAPBPP (4096 / BSIZE)  // swap blocks per page
+
 #define NDIRECT 12
 #define NINDIRECT (BSIZE / sizeof(uint))
 #define MAXFILE (NDIRECT + NINDIRECT)
@@ -0,0 +1,73 @@
+// Futexes: sleeping and waking on user memory words.
+//
+// A waiter is keyed by the kernel address of the word, so
+// threads sharing a pgdir and processes sharing a shm segment
+// find each other.  futexlock is held from the check of the
+// word's value until the waiter is asleep, and by futexwake()
+// while it wakes, so no wakeup can be lost in between.  The page
+// cannot move while anyone sleeps on it: sleepers are in the
+// kernel, which keeps swap away from their memory.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "proc.h"
+
+static struct spinlock futexlock;
+
+void
+futexinit(void)
+{
+  initlock(&futexlock, "futex");
+}
+
+// Kernel address of the user word at addr, which the
+// caller has checked is present.
+static uint*
+futexkey(uint addr)
+{
+  char *page;
+
+  if(addr % 4 || (page = uva2ka(proc->pgdir, (char*)addr)) == 0)
+    return 0;
+  return (uint*)(page + addr % PGSIZE);
+}
+
+// Sleep until woken by futexwake(), if the word at addr
+// still holds val.  Returns 0 if woken, -1 if the word had
+// changed or the process was killed.
+int
+futexwait(uint addr, uint val)
+{
+  uint *key;
+
+  if((key = futexkey(addr)) == 0)
+    return -1;
+  acquire(&futexlock);
+  if(*key != val || proc->killed){
+    release(&futexlock);
+    return -1;
+  }
+  sleep(key, &futexlock);
+  release(&futexlock);
+  return proc->killed ? -1 : 0;
+}
+
+// Wake up to n waiters on the word at addr.
+// Returns the number woken.
+int
+futexwake(uint addr, int n)
+{
+  uint *key;
+  int woken;
+
+  if((key = futexkey(addr)) == 0)
+    return -1;
+  acquire(&futexlock);
+  woken = wakeupn(key, n);
+  release(&futexlock);
+  return woken;
+}
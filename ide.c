@@ -1,16 +1,18 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// Simple IDE driver code.  Uses PCI bus-master DMA when the
+// controller and disk support it, and PIO otherwise.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "x86.h"
 #include "traps.h"
-#include "spinlock.h"
 #include "fs.h"
 #include "buf.h"
+#include "pci.h"
 
 #define SECTOR_SIZE   512
 #define IDE_BSY       0x80
@@ -18,18 +20,58 @@
 #define IDE_DF        0x20
 #define IDE_ERR       0x01
 
+#define IDE_DRQ       0x08
+
 #define IDE_CMD_READ  0x20
 #define IDE_CMD_WRITE 0x30
+#define IDE_CMD_RDMUL 0xc4
+#define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_SETMUL 0xc6
+#define IDE_CMD_IDENT 0xec
+#define IDE_CMD_RDDMA 0xc8
+#define IDE_CMD_WRDMA 0xca
+
+// Bus-master DMA registers, at I/O BAR 4 of the controller.
+#define BM_CMD        0    // command
+#define BM_STATUS     2
+#define BM_PRDT       4    // physical address of PRD table
+#define BM_START      0x01 // command: start transfer
+#define BM_TODEV      0x00 // command: memory to disk
+#define BM_TOMEM      0x08 // command: disk to memory
+#define BM_ERR        0x02 // status: error
+#define BM_INTR       0x04 // status: interrupt; write 1 to clear
+#define PRD_EOT       0x8000
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
-// You must hold idelock while manipulating queue.
+// Physical region descriptor: one piece of a DMA transfer.
+struct prd {
+  uint addr;
+  ushort count;   // bytes
+  ushort flags;
+};
+
+#define MAXSECT       256  // sectors per command
+
+// idequeue points to the bufs waiting for the disk, in the
+// order kept by the I/O scheduler (iosched.c).
+// ideactive points to the bufs now being read/written to the disk:
+// up to MAXSECT sectors of consecutive blocks on one disk, all
+// reads or all writes, linked through qnext.
+// You must hold idelock while manipulating the queues.
 
 static struct spinlock idelock;
 static struct buf *idequeue;
+static struct buf *ideactive;
+static int idensect;     // sectors in the active request
+static int idedone;      // sectors of it transferred so far
+static int idemult[2];   // sectors per interrupt with READ/WRITE MULTIPLE, or 0
+static int idedma[2];    // disk can use DMA
+static ushort bmbase;    // bus-master registers, or 0
+static struct prd *prdt; // one entry per buf of the active request
 
 static int havedisk1;
-static void idestart(struct buf*);
+static int virtiodisk;   // disk 1 is a virtio-blk device
+static int ideplugged;   // hold new requests; see ideplug()
+static void idestart(void);
 
 // Wait for IDE disk to become ready.
 static int
@@ -44,12 +86,63 @@ idewait(int checkerr)
   return 0;
 }
 
+// Find the PCI IDE controller and set up bus-master DMA
+// for the primary channel.  Leaves bmbase 0 if there is none.
+static void
+idedmainit(void)
+{
+  struct pcidev *d;
+
+  if((d = pcifind(-1, -1, 0x01, 0x01)) == 0)  // mass storage, IDE
+    return;
+  if((d->progif & 0x80) == 0 || d->bar[4] == 0)  // no bus mastering
+    return;
+  if((prdt = (struct prd*)kalloc()) == 0)
+    return;
+  pcienable(d);
+  bmbase = d->bar[4];
+}
+
+// Identify disk dev and note how it can move data: turn on
+// multiple mode, so one interrupt moves several sectors, and
+// use DMA if both the disk and the controller can.
+static void
+ideprobe(int dev)
+{
+  ushort id[256];
+  int n;
+
+  outb(0x1f6, 0xe0 | (dev<<4));
+  outb(0x1f7, IDE_CMD_IDENT);
+  if(idewait(1) < 0 || (inb(0x1f7) & IDE_DRQ) == 0)
+    return;
+  insl(0x1f0, id, sizeof(id)/4);
+
+  // Word 49 bit 8: DMA supported.
+  idedma[dev] = bmbase && (id[49] & 0x100);
+
+  // Word 47 holds the largest multiple count the disk
+  // supports; use the largest power of two no bigger than it.
+  if((id[47] & 0xff) == 0)
+    return;
+  for(n = 1; n*2 <= (id[47] & 0xff) && n*2 <= MAXSECT/2; n *= 2)
+    ;
+  outb(0x1f2, n);
+  outb(0x1f6, 0xe0 | (dev<<4));
+  outb(0x1f7, IDE_CMD_SETMUL);
+  if(idewait(1) < 0)
+    return;
+  idemult[dev] = n;
+}
+
 void
 ideinit(void)
 {
   int i;
   
   initlock(&idelock, "ide");
+  // With a virtio disk (make VIRTIO=1), it holds the file system.
+  virtiodisk = virtioinit();
   picenable(IRQ_IDE);
   ioapicenable(IRQ_IDE, ncpu - 1);
   idewait(0);
@@ -62,78 +155,227 @@ ideinit(void)
       break;
     }
   }
+
+  // Probe the disks with the disk interrupt masked.
+  idedmainit();
+  outb(0x3f6, 2);
+  ideprobe(0);
+  if(havedisk1)
+    ideprobe(1);
   
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0<<4));
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Move n sectors between the disk and the active bufs,
+// starting idedone sectors into the request.
+// Caller must hold idelock.
+static void
+idexfer(int n)
+{
+  struct buf *b;
+  int i, s;
+
+  b = ideactive;
+  for(s = idedone; s >= BSIZE/SECTOR_SIZE; s -= BSIZE/SECTOR_SIZE)
+    b = b->qnext;
+  for(i = 0; i < n; i++){
+    if(b->flags & B_DIRTY)
+      outsl(0x1f0, b->data + s*SECTOR_SIZE, SECTOR_SIZE/4);
+    else
+      insl(0x1f0, b->data + s*SECTOR_SIZE, SECTOR_SIZE/4);
+    if(++s == BSIZE/SECTOR_SIZE){
+      s = 0;
+      b = b->qnext;
+    }
+  }
+  idedone += n;
+}
+
+// Sectors moved per interrupt for the active request.
+static int
+idechunk(void)
+{
+  int n;
+
+  n = idemult[ideactive->dev&1];
+  if(n == 0)
+    n = 1;
+  if(n > idensect - idedone)
+    n = idensect - idedone;
+  return n;
+}
+
+// Point the PRD table at the active bufs and get the
+// controller ready for a transfer in the given direction.
+// Caller must hold idelock.
+static void
+idedmastart(int write)
+{
+  struct buf *b;
+  int i;
+
+  // A buf never spans a page, so each is one physically
+  // contiguous region.
+  i = 0;
+  for(b = ideactive; b; b = b->qnext){
+    prdt[i].addr = v2p(b->data);
+    prdt[i].count = BSIZE;
+    prdt[i].flags = 0;
+    i++;
+  }
+  prdt[i-1].flags = PRD_EOT;
+  outl(bmbase + BM_PRDT, v2p(prdt));
+  outb(bmbase + BM_CMD, write ? BM_TODEV : BM_TOMEM);
+  outb(bmbase + BM_STATUS, BM_INTR|BM_ERR);  // clear
+}
+
+// Take the first queued buf, and any queued bufs that
+// continue it block by block, off idequeue and start them
+// as one request.  Caller must hold idelock.
 static void
-idestart(struct buf *b)
+idestart(void)
 {
-  if(b == 0)
+  struct buf *b, *last, **pp;
+  int sector_per_block =  BSIZE/SECTOR_SIZE;
+  int sector, write, mult;
+
+  if((b = ioschednext(&idequeue)) == 0)
     panic("idestart");
-  if(b->blockno >= FSSIZE)
+  ideactive = last = b;
+  idensect = sector_per_block;
+  idedone = 0;
+
+  // Merge: pull forward queued bufs for the next block.
+  while(idensect + sector_per_block <= MAXSECT){
+    for(pp=&idequeue; (b = *pp) != 0; pp=&b->qnext)
+      if(b->dev == last->dev && b->blockno == last->blockno + 1 &&
+         (b->flags & B_DIRTY) == (last->flags & B_DIRTY))
+        break;
+    if(b == 0)
+      break;
+    *pp = b->qnext;
+    b->qnext = 0;
+    last->qnext = b;
+    last = b;
+    idensect += sector_per_block;
+  }
+
+  b = ideactive;
+  write = (b->flags & B_DIRTY) != 0;
+  if(last->blockno >= FSSIZE + NSWAPPAGES*SWAPBPP)
     panic("incorrect blockno");
-  int sector_per_block =  BSIZE/SECTOR_SIZE;
-  int sector = b->blockno * sector_per_block;
+  sector = b->blockno * sector_per_block;
+  mult = idemult[b->dev&1] != 0;
+  if(idedma[b->dev&1])
+    idedmastart(write);
 
-  if (sector_per_block > 7) panic("idestart");
-  
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  outb(0x1f2, idensect & 0xff);  // number of sectors; 0 means 256
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
-  if(b->flags & B_DIRTY){
-    outb(0x1f7, IDE_CMD_WRITE);
-    outsl(0x1f0, b->data, BSIZE/4);
+  if(idedma[b->dev&1]){
+    outb(0x1f7, write ? IDE_CMD_WRDMA : IDE_CMD_RDDMA);
+    outb(bmbase + BM_CMD, (write ? BM_TODEV : BM_TOMEM) | BM_START);
+  } else if(write){
+    outb(0x1f7, mult ? IDE_CMD_WRMUL : IDE_CMD_WRITE);
+    idexfer(idechunk());
   } else {
-    outb(0x1f7, IDE_CMD_READ);
+    outb(0x1f7, mult ? IDE_CMD_RDMUL : IDE_CMD_READ);
   }
 }
 
 // Interrupt handler.
+// Called once per DMA request, or in PIO once per sector (per
+// idemult sectors in multiple mode) until the whole active
+// request has been moved.
 void
 ideintr(void)
 {
-  struct buf *b;
+  struct buf *b, *next, *cb;
 
-  // First queued buffer is the active request.
   acquire(&idelock);
-  if((b = idequeue) == 0){
+  if((b = ideactive) == 0){
     release(&idelock);
     // cprintf("spurious IDE interrupt\n");
     return;
   }
-  idequeue = b->qnext;
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+  if(idedma[b->dev&1]){
+    // The whole request is done: stop the controller and
+    // clear its interrupt; reading the disk status acks it.
+    outb(bmbase + BM_CMD, 0);
+    outb(bmbase + BM_STATUS, BM_INTR|BM_ERR);
+    idewait(1);
+    idedone = idensect;
+  } else if(b->flags & B_DIRTY){
+    // The disk took the last chunk; send the next one.
+    if(idedone < idensect){
+      idewait(0);
+      idexfer(idechunk());
+      release(&idelock);
+      return;
+    }
+  } else {
+    // Read data if needed.
+    if(idewait(1) >= 0)
+      idexfer(idechunk());
+    else
+      idedone = idensect;
+    if(idedone < idensect){
+      release(&idelock);
+      return;
+    }
+  }
   
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  // Wake processes waiting for these bufs, and collect
+  // the bufs with completion callbacks on cb.
+  ideactive = 0;
+  cb = 0;
+  for(; b; b = next){
+    next = b->qnext;
+    ioscheddone(b);
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if(b->done){
+      b->qnext = cb;
+      cb = b;
+    } else
+      wakeup(b);
+  }
   
-  // Start disk on next buf in queue.
-  if(idequeue != 0)
-    idestart(idequeue);
+  // Start disk on next bufs in queue.
+  if(idequeue != 0 && !ideplugged)
+    idestart();
 
   release(&idelock);
+
+  // Completion callbacks run without idelock, in interrupt
+  // context, so they must not sleep.
+  for(b = cb; b; b = next){
+    void (*done)(struct buf*) = b->done;
+    next = b->qnext;
+    b->done = 0;
+    done(b);
+  }
 }
 
 //PAGEBREAK!
-// Sync buf with disk. 
+// Queue b for the disk and return without waiting.
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
+// When the request is done, ideintr() calls b->done(b) if it
+// is set; otherwise the caller must wait with ideawait(b).
 void
-iderw(struct buf *b)
+idesubmit(struct buf *b)
 {
-  struct buf **pp;
+  if(b->dev == 1 && virtiodisk){
+    virtiosubmit(b);
+    return;
+  }
 
   if(!(b->flags & B_BUSY))
     panic("iderw: buf not busy");
@@ -144,20 +386,62 @@ iderw(struct buf *b)
 
   acquire(&idelock);  //DOC:acquire-lock
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
-  *pp = b;
+  ioschedadd(&idequeue, b);  //DOC:insert-queue
   
   // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
-  
-  // Wait for request to finish.
+  if(ideactive == 0 && !ideplugged)
+    idestart();
+
+  release(&idelock);
+}
+
+// Wait for a request started by idesubmit() without a
+// done callback to finish.
+void
+ideawait(struct buf *b)
+{
+  if(b->dev == 1 && virtiodisk){
+    virtioawait(b);
+    return;
+  }
+
+  acquire(&idelock);
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
     sleep(b, &idelock);
   }
+  release(&idelock);
+}
+
+// Hold new requests in the queue until ideunplug(), so a
+// burst of them can be merged into fewer disk commands.
+// Calls nest.  Do not sleep while plugged.
+void
+ideplug(void)
+{
+  acquire(&idelock);
+  ideplugged++;
+  release(&idelock);
+  if(virtiodisk)
+    virtioplug();
+}
 
+void
+ideunplug(void)
+{
+  acquire(&idelock);
+  if(--ideplugged == 0 && ideactive == 0 && idequeue != 0)
+    idestart();
   release(&idelock);
+  if(virtiodisk)
+    virtiounplug();
+}
+
+// Sync buf with disk. 
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+void
+iderw(struct buf *b)
+{
+  idesubmit(b);
+  ideawait(b);
 }
@@ -0,0 +1,158 @@
+// Disk request scheduler.
+//
+// ide.c keeps waiting requests on idequeue and asks this file
+// where to put a new one and which one to start next.  The
+// policy is picked at build time with IOSCHED:
+//
+// * FIFO     requests go in arrival order.
+// * CLOOK    the queue is sorted by disk and block, and the head
+//              sweeps upward, jumping back to the lowest waiting
+//              block once nothing is left above it.
+// * DEADLINE like CLOOK, but a request that has waited longer
+//              than its deadline is served first, so a busy
+//              region of the disk cannot starve the rest.
+//
+// All functions are called with idelock held.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "fs.h"
+#include "buf.h"
+
+#define READEXPIRE   5    // deadlines, in ticks
+#define WRITEEXPIRE  50
+
+static struct {
+  uint head;        // block after the last one started
+  uint headdev;
+  uint depth;       // requests in the driver, waiting or active
+  uint maxdepth;
+  uint sumdepth;    // depth seen by each new request, summed
+  uint nreq;        // completed requests
+  uint sumlat;      // ticks from queueing to completion, summed
+  uint maxlat;
+  uint nexpired;    // requests served early for their deadline
+} ios;
+
+#if defined(IO_CLOOK) || defined(IO_DEADLINE)
+// Does a come before b in sweep order?
+static int
+before(struct buf *a, struct buf *b)
+{
+  if(a->dev != b->dev)
+    return a->dev < b->dev;
+  return a->blockno < b->blockno;
+}
+#endif
+
+// Add b to the queue *q.
+void
+ioschedadd(struct buf **q, struct buf *b)
+{
+  struct buf **pp;
+
+  b->qtime = ticks;
+  if(++ios.depth > ios.maxdepth)
+    ios.maxdepth = ios.depth;
+  ios.sumdepth += ios.depth;
+
+  b->qnext = 0;
+#if defined(IO_CLOOK) || defined(IO_DEADLINE)
+  for(pp=q; *pp && !before(b, *pp); pp=&(*pp)->qnext)
+    ;
+  b->qnext = *pp;
+#else
+  for(pp=q; *pp; pp=&(*pp)->qnext)
+    ;
+#endif
+  *pp = b;
+}
+
+// Take the next request to start off the queue *q.
+// Returns 0 if the queue is empty.
+struct buf*
+ioschednext(struct buf **q)
+{
+  struct buf **pick, *b;
+#if defined(IO_CLOOK) || defined(IO_DEADLINE)
+  struct buf **pp;
+#endif
+#ifdef IO_DEADLINE
+  struct buf **old;
+  uint expire;
+#endif
+
+  if(*q == 0)
+    return 0;
+  pick = q;
+#if defined(IO_CLOOK) || defined(IO_DEADLINE)
+  // First request at or above the head, else wrap to the lowest.
+  for(pp=q; *pp; pp=&(*pp)->qnext){
+    b = *pp;
+    if(b->dev > ios.headdev || (b->dev == ios.headdev && b->blockno >= ios.head)){
+      pick = pp;
+      break;
+    }
+  }
+#endif
+#ifdef IO_DEADLINE
+  // The oldest expired request, if any, goes first.
+  old = 0;
+  for(pp=q; *pp; pp=&(*pp)->qnext){
+    b = *pp;
+    expire = (b->flags & B_DIRTY) ? WRITEEXPIRE : READEXPIRE;
+    if(ticks - b->qtime > expire && (old == 0 || b->qtime < (*old)->qtime))
+      old = pp;
+  }
+  if(old && old != pick){
+    pick = old;
+    ios.nexpired++;
+  }
+#endif
+  b = *pick;
+  *pick = b->qnext;
+  b->qnext = 0;
+  ios.headdev = b->dev;
+  ios.head = b->blockno + 1;
+  return b;
+}
+
+// Note that request b has finished.
+void
+ioscheddone(struct buf *b)
+{
+  uint lat;
+
+  lat = ticks - b->qtime;
+  ios.depth--;
+  ios.nreq++;
+  ios.sumlat += lat;
+  if(lat > ios.maxlat)
+    ios.maxlat = lat;
+}
+
+// Print queue depth and latency statistics to the console.
+// Runs when user types ^P on console.
+// No lock to avoid wedging a stuck machine further.
+void
+ioscheddump(void)
+{
+#if defined(IO_DEADLINE)
+  char *name = "deadline";
+#elif defined(IO_CLOOK)
+  char *name = "c-look";
+#else
+  char *name = "fifo";
+#endif
+
+  cprintf("iosched %s: %d done, depth %d max %d avg %d, "
+          "latency avg %d max %d ticks",
+          name, ios.nreq, ios.depth, ios.maxdepth,
+          ios.nreq ? ios.sumdepth/ios.nreq : 0,
+          ios.nreq ? ios.sumlat/ios.nreq : 0, ios.maxlat);
+#ifdef IO_DEADLINE
+  cprintf(", %d expired", ios.nexpired);
+#endif
+  cprintf("\n");
+}
@@ -1,6 +1,19 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
-// and pipe buffers. Allocates 4096-byte pages.
+// and pipe buffers. Allocates 4096-byte pages, or physically
+// contiguous blocks of 2^order pages.
+//
+// Free memory is kept in a binary buddy system. A free block of
+// order n is 2^n pages long and aligned to its size in physical
+// memory; its buddy is the block whose page number differs only
+// in bit n. kfreepages() merges a block with its buddy whenever
+// the buddy is free too, so large blocks reappear as memory is
+// returned. kalloc()/kfree() are simply order-0 requests.
+//
+// Most callers want zeroed pages (page tables, user memory).
+// kzalloc() serves them from a pool of pages that idle CPUs
+// clear ahead of time in kzerofill(), so the memset is off the
+// fork/exec/sbrk path.
 
 #include "types.h"
 #include "defs.h"
@@ -9,19 +22,54 @@
 #include "mmu.h"
 #include "spinlock.h"
 
+#define NPHYSPAGES  (PHYSTOP/PGSIZE)
+#define PG_FREE     0x80  // pgstate: page heads a free block
+#define NZEROPAGES  256   // target size of the pre-zeroed pool
+#define ZEROBATCH   8     // pages zeroed per kzerofill() call
+
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
 
+// Free blocks are linked through their first page.
 struct run {
   struct run *next;
+  struct run *prev;
 };
 
 struct {
   struct spinlock lock;
   int use_lock;
-  struct run *freelist;
+  struct run freelist[MAXORDER+1]; // list heads, one per order
+  uint nfree[MAXORDER+1];          // # free blocks of each order
+  uchar pgstate[NPHYSPAGES];       // PG_FREE|order for free block heads
+  uchar pgref[NPHYSPAGES];         // extra holders of a page; see kdup()
+  struct run *zerolist;            // pre-zeroed pages, linked by first word
+  uint nzero;                      // # pages on zerolist
 } kmem;
 
+static void
+listinit(struct run *head)
+{
+  head->next = head;
+  head->prev = head;
+}
+
+static void
+listpush(struct run *head, struct run *r)
+{
+  r->next = head->next;
+  r->prev = head;
+  head->next->prev = r;
+  head->next = r;
+}
+
+static void
+listremove(struct run *r)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+}
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
@@ -30,8 +78,12 @@ struct {
 void
 kinit1(void *vstart, void *vend)
 {
+  int i;
+
   initlock(&kmem.lock, "kmem");
   kmem.use_lock = 0;
+  for(i = 0; i <= MAXORDER; i++)
+    listinit(&kmem.freelist[i]);
   freerange(vstart, vend);
 }
 
@@ -51,46 +103,263 @@ freerange(void *vstart, void *vend)
     kfree(p);
 }
 
-//PAGEBREAK: 21
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
-void
-kfree(char *v)
+// Put the free block of 2^order pages at page number pn on
+// the free lists, merging it with its buddies.
+// Caller must hold kmem.lock.
+static void
+buddyfree(uint pn, int order)
+{
+  uint bn;
+
+  for(; order < MAXORDER; order++){
+    bn = pn ^ (1 << order);
+    if(bn >= NPHYSPAGES || kmem.pgstate[bn] != (PG_FREE|order))
+      break;
+    listremove((struct run*)p2v(bn * PGSIZE));
+    kmem.pgstate[bn] = 0;
+    kmem.nfree[order]--;
+    pn &= ~(1 << order);
+  }
+  kmem.pgstate[pn] = PG_FREE|order;
+  kmem.nfree[order]++;
+  listpush(&kmem.freelist[order], (struct run*)p2v(pn * PGSIZE));
+}
+
+// Give every page of the pre-zeroed pool back to the free
+// lists, so they can merge into larger blocks.
+// Returns the number of pages drained.
+// Caller must hold kmem.lock.
+static uint
+zerodrain(void)
 {
   struct run *r;
+  uint n;
+
+  n = kmem.nzero;
+  while((r = kmem.zerolist) != 0){
+    kmem.zerolist = r->next;
+    buddyfree(v2p(r) / PGSIZE, 0);
+  }
+  kmem.nzero = 0;
+  return n;
+}
 
-  if((uint)v % PGSIZE || v < end || v2p(v) >= PHYSTOP)
+//PAGEBREAK: 21
+// Free the 2^order pages of physical memory pointed at by v,
+// which normally should have been returned by a call to
+// kallocpages(order).  (The exception is when initializing
+// the allocator; see kinit above.)  Merges the block with
+// its buddy for as long as the buddy is free as well.
+void
+kfreepages(char *v, int order)
+{
+  if(order < 0 || order > MAXORDER)
+    panic("kfreepages: order");
+  if((uint)v % (PGSIZE << order) || v < end ||
+     v2p(v) + (PGSIZE << order) > PHYSTOP)
     panic("kfree");
 
+#ifdef MEMDEBUG
   // Fill with junk to catch dangling refs.
-  memset(v, 1, PGSIZE);
+  memset(v, 1, PGSIZE << order);
+#endif
 
   if(kmem.use_lock)
     acquire(&kmem.lock);
-  r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+  buddyfree(v2p(v) / PGSIZE, order);
   if(kmem.use_lock)
     release(&kmem.lock);
 }
 
-// Allocate one 4096-byte page of physical memory.
-// Returns a pointer that the kernel can use.
+// Allocate 2^order physically contiguous pages, aligned
+// to their size.  Splits a larger free block if no block
+// of the requested order is free, and as a last resort
+// drains the pre-zeroed pool so its pages can merge.
 // Returns 0 if the memory cannot be allocated.
 char*
-kalloc(void)
+kallocpages(int order)
 {
   struct run *r;
+  uint pn;
+  int o;
+
+  if(order < 0 || order > MAXORDER)
+    panic("kallocpages: order");
 
   if(kmem.use_lock)
     acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
+again:
+  for(o = order; o <= MAXORDER; o++)
+    if(kmem.freelist[o].next != &kmem.freelist[o])
+      break;
+  if(o > MAXORDER && order > 0 && zerodrain() > 0)
+    goto again;
+  if(o > MAXORDER){
+    if(kmem.use_lock)
+      release(&kmem.lock);
+    return 0;
+  }
+  r = kmem.freelist[o].next;
+  listremove(r);
+  kmem.nfree[o]--;
+  pn = v2p(r) / PGSIZE;
+  kmem.pgstate[pn] = 0;
+
+  // Return the upper halves to the free lists.
+  while(o > order){
+    o--;
+    kmem.pgstate[pn + (1 << o)] = PG_FREE|o;
+    kmem.nfree[o]++;
+    listpush(&kmem.freelist[o], (struct run*)p2v((pn + (1 << o)) * PGSIZE));
+  }
   if(kmem.use_lock)
     release(&kmem.lock);
   return (char*)r;
 }
 
+// Free the page of physical memory pointed at by v.
+void
+kfree(char *v)
+{
+  kfreepages(v, 0);
+}
+
+// Note one more holder of the page v, such as a second page
+// table mapping it.  Every holder then lets go with kput().
+void
+kdup(char *v)
+{
+  acquire(&kmem.lock);
+  if(kmem.pgref[v2p(v) / PGSIZE]++ == 0xff)
+    panic("kdup");
+  release(&kmem.lock);
+}
+
+// Let go of the page v, freeing it if this was the last holder.
+void
+kput(char *v)
+{
+  uint pn;
+
+  pn = v2p(v) / PGSIZE;
+  acquire(&kmem.lock);
+  if(kmem.pgref[pn] > 0){
+    kmem.pgref[pn]--;
+    release(&kmem.lock);
+    return;
+  }
+  release(&kmem.lock);
+  kfree(v);
+}
+
+// Take a page off the pre-zeroed pool, or return 0 if it is empty.
+static char*
+zeroget(void)
+{
+  struct run *r;
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  r = kmem.zerolist;
+  if(r){
+    kmem.zerolist = r->next;
+    kmem.nzero--;
+  }
+  if(kmem.use_lock)
+    release(&kmem.lock);
+  if(r)
+    r->next = 0;  // the only non-zero word
+  return (char*)r;
+}
+
+// Allocate one 4096-byte page of physical memory.
+// Returns a pointer that the kernel can use.
+// Returns 0 if the memory cannot be allocated.
+char*
+kalloc(void)
+{
+  char *v;
+
+  if((v = kallocpages(0)) == 0)
+    v = zeroget();
+  return v;
+}
+
+// Allocate one zeroed page.
+// Returns 0 if the memory cannot be allocated.
+char*
+kzalloc(void)
+{
+  char *v;
+
+  if((v = zeroget()) != 0)
+    return v;
+  if((v = kallocpages(0)) != 0)
+    memset(v, 0, PGSIZE);
+  return v;
+}
+
+// Top up the pre-zeroed pool by a few pages.
+// Called by the scheduler when it finds nothing to run.
+void
+kzerofill(void)
+{
+  struct run *r;
+  int i;
+
+  if(!kmem.use_lock)  // other CPUs may still be in kinit2()
+    return;
+  for(i = 0; i < ZEROBATCH && kmem.nzero < NZEROPAGES; i++){
+    if((r = (struct run*)kallocpages(0)) == 0)
+      return;
+    memset(r, 0, PGSIZE);
+    acquire(&kmem.lock);
+    r->next = kmem.zerolist;
+    kmem.zerolist = r;
+    kmem.nzero++;
+    release(&kmem.lock);
+  }
+}
+
+// Number of free pages, including the pre-zeroed pool.
+uint
+kfreecount(void)
+{
+  uint n;
+  int i;
+
+  acquire(&kmem.lock);
+  n = kmem.nzero;
+  for(i = 0; i <= MAXORDER; i++)
+    n += kmem.nfree[i] << i;
+  release(&kmem.lock);
+  return n;
+}
+
+// Print free block counts and fragmentation to the console.
+// For each order, the unusable index is the percentage of
+// free memory that sits in blocks too small to satisfy a
+// request of that order.  Runs when user types ^P on console.
+void
+kmemdump(void)
+{
+  uint nfree[MAXORDER+1], total, below, nzero;
+  int i;
+
+  acquire(&kmem.lock);
+  for(i = 0; i <= MAXORDER; i++)
+    nfree[i] = kmem.nfree[i];
+  nzero = kmem.nzero;
+  release(&kmem.lock);
+
+  total = 0;
+  for(i = 0; i <= MAXORDER; i++)
+    total += nfree[i] << i;
+  cprintf("kmem: %d free pages, %d pre-zeroed\norder  blocks  unusable%%\n",
+          total, nzero);
+  below = 0;
+  for(i = 0; i <= MAXORDER; i++){
+    cprintf("%d  %d  %d\n", i, nfree[i], total ? below*100/total : 0);
+    below += nfree[i] << i;
+  }
+}
@@ -1,23 +1,38 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "spinlock.h"
+#include "proc.h"
 #include "fs.h"
 #include "buf.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
-// write an uncommitted system call's updates to disk.
+// calls. A transaction is only closed when there are no FS
+// system calls active in it. Thus there is never any reasoning
+// required about whether a commit might write an uncommitted
+// system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the logger takes the transaction.
+//
+// Commits run in a kernel thread, the logger (group commit).
+// Once the open transaction has blocks in it, the logger holds
+// off new system calls until the active ones finish, copies
+// every block of the transaction into the log buffers, and
+// lets new system calls go on in a fresh transaction while it
+// writes the old one out.  Everything that finishes while a
+// commit is being written goes into the next commit together.
+// A system call that logged blocks waits in end_op() until the
+// commit holding them is on disk, so it is durable when it
+// returns; the system calls that share a commit wake up together.
+// log_write() notes the transaction in proc->logseq.  System
+// calls that logged nothing return at once.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -26,12 +41,18 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// The log keeps private buffers for the log blocks and header,
+// outside the buffer cache.  A commit starts all its log writes
+// at once with the disk plugged (bplug()), so the driver sends
+// the log as one contiguous transfer, and then does the same
+// with the install writes so neighbouring blocks merge.  The
+// header write that erases a transaction is not waited for;
+// the next commit waits for it before writing the log.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
-  int n;   
+  int n;
   int block[LOGSIZE];
 };
 
@@ -40,18 +61,28 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int freezing;    // logger is closing the transaction, please wait.
   int dev;
-  struct logheader lh;
+  uint seq;        // number of the open transaction
+  uint committed;  // transactions up to this one are on disk
+  struct logheader lh;   // open transaction
+  struct logheader clh;  // transaction being committed; logger only
+  uint cseq;             // its number; logger only
+  struct buf *lbuf[LOGSIZE];  // private copies of the blocks of clh
+  struct buf *hbuf;           // private header block
+  int hpending;               // hbuf write not yet waited for
 };
 struct log log;
 
 static void recover_from_log(void);
 static void commit();
+static void logger(void*);
 
 void
 initlog(int dev)
 {
+  int i;
+
   if (sizeof(struct logheader) >= BSIZE)
     panic("initlog: too big logheader");
 
@@ -61,63 +92,108 @@ initlog(int dev)
   log.start = sb.logstart;
   log.size = sb.nlog;
   log.dev = dev;
+  log.seq = 1;
+  for (i = 0; i <= LOGSIZE; i++) {
+    struct buf *b = kmalloc(sizeof(struct buf));
+    if (b == 0)
+      panic("initlog: buffers");
+    memset(b, 0, sizeof(struct buf));
+    b->dev = dev;
+    if (i < LOGSIZE)
+      log.lbuf[i] = b;
+    else
+      log.hbuf = b;
+  }
+  log.hbuf->blockno = log.start;
   recover_from_log();
+  if (kthreadcreate(logger, 0, "logger") == 0)
+    panic("initlog: logger");
 }
 
-// Copy committed blocks from log to their home location
-static void 
+// Write the blocks of clh from the log buffers to their home
+// location.  The cached copies may already hold updates of the
+// next transaction, so the writes come from the log buffers.
+static void
 install_trans(void)
 {
   int tail;
+  struct buf *b;
+
+  bplug();
+  for (tail = 0; tail < log.clh.n; tail++) {
+    b = log.lbuf[tail];
+    b->blockno = log.clh.block[tail];
+    b->flags = B_BUSY;
+    bwritestart(b);  // write dst to disk
+  }
+  bunplug();
+  for (tail = 0; tail < log.clh.n; tail++)
+    bwait(log.lbuf[tail]);
+}
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    brelse(lbuf); 
-    brelse(dbuf);
+// Wait for the last header write, if it is still in flight.
+static void
+wait_head(void)
+{
+  if (log.hpending) {
+    bwait(log.hbuf);
+    log.hpending = 0;
   }
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the log header from disk into clh
 static void
 read_head(void)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
+  struct logheader *lh = (struct logheader *) (log.hbuf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+
+  log.hbuf->flags = B_BUSY;
+  iderw(log.hbuf);
+  log.clh.n = lh->n;
+  for (i = 0; i < log.clh.n; i++) {
+    log.clh.block[i] = lh->block[i];
   }
-  brelse(buf);
 }
 
-// Write in-memory log header to disk.
+// Write clh to disk.
 // This is the true point at which the
 // current transaction commits.
+// If wait is 0, only start the write.
 static void
-write_head(void)
+write_head(int wait)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
+  struct logheader *hb = (struct logheader *) (log.hbuf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+
+  wait_head();
+  hb->n = log.clh.n;
+  for (i = 0; i < log.clh.n; i++) {
+    hb->block[i] = log.clh.block[i];
   }
-  bwrite(buf);
-  brelse(buf);
+  log.hbuf->flags = B_BUSY;
+  bwritestart(log.hbuf);
+  log.hpending = 1;
+  if (wait)
+    wait_head();
 }
 
 static void
 recover_from_log(void)
 {
-  read_head();      
+  int tail;
+  struct buf *b;
+
+  read_head();
+  for (tail = 0; tail < log.clh.n; tail++) {
+    b = log.lbuf[tail];
+    b->blockno = log.start+tail+1;
+    b->flags = B_BUSY;
+    iderw(b);  // read log block
+  }
   install_trans(); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  log.clh.n = 0;
+  write_head(1); // clear the log
 }
 
 // called at the start of each FS system call.
@@ -126,13 +202,15 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.freezing){
       sleep(&log, &log.lock);
     } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+      // this op might exhaust log space; wait for the logger
+      // to take the transaction.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      proc->logseq = 0;
       release(&log.lock);
       break;
     }
@@ -140,67 +218,138 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// the logger commits once the transaction has no
+// outstanding operations; if this call logged any
+// blocks, wait for that commit.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  uint seq;
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space.
-    wakeup(&log);
+  if(log.outstanding < 0)
+    panic("end_op");
+  // begin_op() may be waiting for log space,
+  // and the logger for the transaction to close.
+  wakeup(&log);
+  if((seq = proc->logseq) != 0){
+    proc->logseq = 0;
+    while((int)(log.committed - seq) < 0)
+      sleep(&log.committed, &log.lock);
   }
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// Copy the blocks of clh from the cache into the log
+// buffers, which keep them while the cache moves on.
+static void
+snapshot(void)
+{
+  int tail;
+
+  for (tail = 0; tail < log.clh.n; tail++) {
+    struct buf *from = bread(log.dev, log.clh.block[tail]); // cache block
+    memmove(log.lbuf[tail]->data, from->data, BSIZE);
+    brelse(from);
   }
 }
 
-// Copy modified blocks from cache to log.
-static void 
+// Write the log buffers to the log, as one batch.
+static void
 write_log(void)
 {
   int tail;
+  struct buf *b;
+
+  wait_head();  // the last erase must land first
+  bplug();
+  for (tail = 0; tail < log.clh.n; tail++) {
+    b = log.lbuf[tail];
+    b->blockno = log.start+tail+1;
+    b->flags = B_BUSY;
+    bwritestart(b);  // write the log
+  }
+  bunplug();
+  for (tail = 0; tail < log.clh.n; tail++)
+    bwait(log.lbuf[tail]);
+}
+
+// Unpin the cached blocks of clh, now that they are on disk,
+// unless the open transaction has logged them again.
+static void
+unpin(void)
+{
+  struct buf *b;
+  int tail, i;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from); 
-    brelse(to);
+  for (tail = 0; tail < log.clh.n; tail++) {
+    b = bread(log.dev, log.clh.block[tail]);
+    acquire(&log.lock);
+    for (i = 0; i < log.lh.n; i++)
+      if (log.lh.block[i] == b->blockno)
+        break;
+    if (i == log.lh.n)
+      b->flags &= ~B_DIRTY;
+    release(&log.lock);
+    brelse(b);
   }
 }
 
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
+  if (log.clh.n > 0) {
+    write_log();     // Write the snapshot to the log
+    write_head(1);   // Write header to disk -- the real commit
+    acquire(&log.lock);
+    log.committed = log.cseq;
+    wakeup(&log.committed);  // end_op() of its system calls
+    release(&log.lock);
     install_trans(); // Now install writes to home locations
-    log.lh.n = 0; 
-    write_head();    // Erase the transaction from the log
+    unpin();
+    log.clh.n = 0;
+    write_head(0);   // Erase the transaction from the log
+  }
+}
+
+// The logger thread: close and commit transactions forever.
+static void
+logger(void *arg)
+{
+  acquire(&log.lock);
+  for(;;){
+    while(log.lh.n == 0)
+      sleep(&log, &log.lock);
+
+    // Close the transaction: let the system calls in it
+    // finish, and hold off new ones while it is copied.
+    log.freezing = 1;
+    while(log.outstanding > 0)
+      sleep(&log, &log.lock);
+    log.clh = log.lh;
+    log.cseq = log.seq++;
+    log.lh.n = 0;
+    release(&log.lock);
+
+    snapshot();
+
+    acquire(&log.lock);
+    log.freezing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    // call commit w/o holding locks, since not allowed
+    // to sleep with locks.
+    commit();
+
+    acquire(&log.lock);
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache with B_DIRTY.
-// commit()/write_log() will do the disk write.
+// The logger will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -225,7 +374,7 @@ log_write(struct buf *b)
   log.lh.block[i] = b->blockno;
   if (i == log.lh.n)
     log.lh.n++;
+  proc->logseq = log.seq;
   b->flags |= B_DIRTY; // prevent eviction
   release(&log.lock);
 }
-
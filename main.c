@@ -3,6 +3,7 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "x86.h"
 
@@ -22,6 +23,7 @@ main(void)
   mpinit();        // collect info about this machine
   lapicinit();
   seginit();       // set up segments
+  slabinit();      // kernel object caches
   cprintf("\ncpu%d: starting xv6\n\n", cpu->id);
   picinit();       // interrupt controller
   ioapicinit();    // another interrupt controller
@@ -31,11 +33,19 @@ main(void)
   tvinit();        // trap vectors
   binit();         // buffer cache
   fileinit();      // file table
+  icacheinit();    // inode cache
+  pipeinit();      // pipe cache
+  shminit();       // shared-memory segments
+  futexinit();     // futex wait queues
+  pciinit();       // PCI devices
   ideinit();       // disk
   if(!ismp)
     timerinit();   // uniprocessor timer
   startothers();   // start other processors
   kinit2(P2V(4*1024*1024), P2V(PHYSTOP)); // must come after startothers()
+#ifdef MEMBENCH
+  membench();      // time string.c copies
+#endif
   userinit();      // first user process
   // Finish setting up this processor in mpmain.
   mpmain();
@@ -57,6 +67,7 @@ mpmain(void)
 {
   cprintf("cpu%d: starting\n", cpu->id);
   idtinit();       // load idt register
+  fpuinit();       // lazy FPU switching
   xchg(&cpu->started, 1); // tell startothers() we're up
   scheduler();     // start running processes
 }
@@ -0,0 +1,399 @@
+// Memory mappings: mmap() and munmap().
+//
+// Each process has a small table of mapped regions (struct vma),
+// placed top-down from KERNBASE so they stay clear of the heap.
+// Pages are not allocated by mmap(); vmafault() fills them in on
+// first touch, zero-filled or read from the file with readi().
+// System calls that take user pointers into a mapping call
+// vmaprefault() so the kernel never faults on them itself.
+//
+// A MAP_SHARED file mapping writes its dirty pages back to the
+// file through the log when it is unmapped, when the process
+// exits, and when it execs.  Write-back never grows the file.
+// fork() faults in every page of a MAP_SHARED mapping, file or
+// anonymous, and gives the child the parent's pages rather than
+// copies (kdup()), so neither process faults in a page of its
+// own later.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "file.h"
+#include "mman.h"
+
+// Return p's mapping that contains va, or 0.
+struct vma*
+vmalookup(struct proc *p, uint va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->start <= va && va < v->end)
+      return v;
+  return 0;
+}
+
+// Lowest address used by p's mappings; the heap may
+// not grow past it.
+uint
+vmalow(struct proc *p)
+{
+  struct vma *v;
+  uint low;
+
+  low = KERNBASE;
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end && v->start < low)
+      low = v->start;
+  return low;
+}
+
+// Find the highest free range of len bytes below KERNBASE.
+// Returns 0 if there is none.
+static uint
+vmaplace(struct proc *p, uint len)
+{
+  struct vma *v;
+  uint end;
+
+  end = KERNBASE;
+again:
+  if(end < len || end - len < PGROUNDUP(p->sz))
+    return 0;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end && v->start < end && end - len < v->end){
+      end = v->start;
+      goto again;
+    }
+  }
+  return end - len;
+}
+
+// Reserve a free slot and address range of len bytes for a new
+// mapping in the current process.  Returns 0 if there is none.
+struct vma*
+vmaalloc(uint len)
+{
+  struct vma *v;
+  uint va;
+
+  for(v = proc->leader->vma; v < &proc->leader->vma[NVMA]; v++){
+    if(v->end == 0){
+      if((va = vmaplace(proc->leader, len)) == 0)
+        return 0;
+      memset(v, 0, sizeof(*v));
+      v->start = va;
+      v->end = va + len;
+      return v;
+    }
+  }
+  return 0;
+}
+
+// Map len bytes of f starting at off, or zero-filled memory if
+// f is 0.  Returns the address of the mapping, or -1.
+int
+mmap(uint len, int prot, int flags, struct file *f, uint off)
+{
+  struct vma *v;
+
+  if(len == 0 || len > KERNBASE || off % PGSIZE)
+    return -1;
+  if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+  if(f){
+    if(f->type != FD_INODE || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+
+  lockvm();
+  if((v = vmaalloc(PGROUNDUP(len))) == 0){
+    unlockvm();
+    return -1;
+  }
+  v->prot = prot;
+  v->flags = flags;
+  v->f = f ? filedup(f) : 0;
+  v->off = off;
+  unlockvm();
+  return v->start;
+}
+
+// Write the page at va of shared mapping v back to its file,
+// a few blocks per transaction as in filewrite().
+static void
+vmawriteback(struct vma *v, uint va, char *mem)
+{
+  struct inode *ip;
+  uint off, n, n1, i, max;
+
+  ip = v->f->ip;
+  off = v->off + (va - v->start);
+  ilock(ip);
+  n = ip->size > off ? ip->size - off : 0;
+  iunlock(ip);
+  if(n > PGSIZE)
+    n = PGSIZE;
+  max = ((LOGSIZE-1-1-2) / 2) * 512;
+  for(i = 0; i < n; i += n1){
+    n1 = n - i;
+    if(n1 > max)
+      n1 = max;
+    begin_op();
+    ilock(ip);
+    writei(ip, mem + i, off + i, n1);
+    iunlock(ip);
+    end_op();
+  }
+}
+
+// Write back the dirty pages of v in [start, end), and
+// unmap and free them if dofree is set.
+static void
+vmaunmap(pde_t *pgdir, struct vma *v, uint start, uint end, int dofree)
+{
+  pte_t *pte;
+  char *mem;
+  uint a;
+
+  for(a = start; a < end; a += PGSIZE){
+    if((pte = walkpgdir(pgdir, (char*)a, 0)) == 0 || (*pte & PTE_P) == 0)
+      continue;
+    mem = p2v(PTE_ADDR(*pte));
+    if(v->f && (v->flags & MAP_SHARED) && (v->prot & PROT_WRITE) && (*pte & PTE_D))
+      vmawriteback(v, a, mem);
+    if(dofree){
+      *pte = 0;
+      unmapfree(pgdir, a, mem, 0);
+    }
+  }
+}
+
+// Remove [va, va+len) from the current process's mappings.
+// Parts of the range that are not mapped are ignored.
+int
+munmap(uint va, uint len)
+{
+  struct vma *v, *nv;
+  uint end, s, e;
+
+  if(va % PGSIZE || len == 0 || va + len < va)
+    return -1;
+  end = PGROUNDUP(va + len);
+
+  lockvm();
+  // Punching a hole needs a free slot for the upper part.
+  nv = 0;
+  for(v = proc->leader->vma; v < &proc->leader->vma[NVMA]; v++)
+    if(v->end == 0){
+      nv = v;
+      break;
+    }
+  for(v = proc->leader->vma; v < &proc->leader->vma[NVMA]; v++){
+    if(v->end == 0 || v->end <= va || end <= v->start)
+      continue;
+    if(v->shm || (v->start < va && end < v->end && nv == 0)){
+      unlockvm();
+      return -1;  // shm segments go with shmdt()
+    }
+  }
+
+  for(v = proc->leader->vma; v < &proc->leader->vma[NVMA]; v++){
+    if(v->end == 0 || v->end <= va || end <= v->start)
+      continue;
+    s = v->start > va ? v->start : va;
+    e = v->end < end ? v->end : end;
+    vmaunmap(proc->pgdir, v, s, e, 1);
+    if(s == v->start && e == v->end){
+      if(v->f)
+        fileclose(v->f);
+      memset(v, 0, sizeof(*v));
+    } else if(s == v->start){
+      v->off += e - v->start;
+      v->start = e;
+    } else if(e == v->end){
+      v->end = s;
+    } else {
+      *nv = *v;
+      nv->start = e;
+      nv->off += e - v->start;
+      if(nv->f)
+        filedup(nv->f);
+      v->end = s;
+    }
+  }
+  switchuvm(proc);
+  unlockvm();
+  return 0;
+}
+
+// Drop all of p's mappings, writing back shared pages.
+// The pages themselves go away with p's page table.
+void
+vmaexit(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0)
+      continue;
+    if(v->f){
+      vmaunmap(p->pgdir, v, v->start, v->end, 0);
+      fileclose(v->f);
+    }
+    if(v->shm)
+      shmrelease(v->shm);
+    memset(v, 0, sizeof(*v));
+  }
+}
+
+// Give child np copies of p's mappings and of the pages
+// that have been faulted in.  Shm segments are attached
+// to np rather than copied, and the pages of MAP_SHARED
+// mappings are all faulted in and shared.  p must be the
+// current process's leader.  Returns 0 on success, -1
+// on failure, in which case np has no mappings left.
+int
+vmacopy(struct proc *np, struct proc *p)
+{
+  struct vma *v, *nv;
+  pte_t *pte;
+  char *mem;
+  uint a;
+
+  for(v = p->vma, nv = np->vma; v < &p->vma[NVMA]; v++, nv++){
+    if(v->end == 0)
+      continue;
+    if((v->flags & MAP_SHARED) && !v->shm)
+      for(a = v->start; a < v->end; a += PGSIZE)
+        if(vmafault(a) < 0)
+          goto bad;
+    *nv = *v;
+    if(nv->f)
+      filedup(nv->f);
+    if(nv->shm)
+      shmdup(nv->shm);
+    for(a = v->start; a < v->end; a += PGSIZE){
+      if((pte = walkpgdir(p->pgdir, (char*)a, 0)) == 0 || (*pte & PTE_P) == 0)
+        continue;
+      if(*pte & PTE_SHARED){
+        if(mappages(np->pgdir, (char*)a, PGSIZE, PTE_ADDR(*pte), PTE_FLAGS(*pte)) < 0)
+          goto bad;
+        continue;
+      }
+      if(v->flags & MAP_SHARED){
+        if(mappages(np->pgdir, (char*)a, PGSIZE, PTE_ADDR(*pte), PTE_FLAGS(*pte)) < 0)
+          goto bad;
+        kdup(p2v(PTE_ADDR(*pte)));
+        continue;
+      }
+      if((mem = ualloc()) == 0)
+        goto bad;
+      memmove(mem, p2v(PTE_ADDR(*pte)), PGSIZE);
+      if(mappages(np->pgdir, (char*)a, PGSIZE, v2p(mem), PTE_FLAGS(*pte)) < 0){
+        kfree(mem);
+        goto bad;
+      }
+    }
+  }
+  return 0;
+
+bad:
+  for(nv = np->vma; nv < &np->vma[NVMA]; nv++){
+    if(nv->f)
+      fileclose(nv->f);
+    if(nv->shm)
+      shmrelease(nv->shm);
+    memset(nv, 0, sizeof(*nv));
+  }
+  return -1;
+}
+
+// Fill in the page holding va if it belongs to a mapping of
+// the current process.  Returns 0 if the page is now present,
+// -1 if va is not mapped or memory ran out.
+// Caller must hold lockvm().
+int
+vmafault(uint va)
+{
+  struct vma *v;
+  pte_t *pte;
+  char *mem;
+  uint a, perm;
+
+  if(proc == 0 || (v = vmalookup(proc->leader, va)) == 0)
+    return -1;
+  a = PGROUNDDOWN(va);
+  if((pte = walkpgdir(proc->pgdir, (char*)a, 0)) != 0 && (*pte & PTE_P))
+    return 0;   // another thread got here first
+  if((mem = ualloc()) == 0)
+    return -1;
+  if(v->f){
+    ilock(v->f->ip);
+    readi(v->f->ip, mem, v->off + (a - v->start), PGSIZE);
+    iunlock(v->f->ip);
+  }
+  perm = PTE_U;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(mappages(proc->pgdir, (char*)a, PGSIZE, v2p(mem), perm) < 0){
+    kfree(mem);
+    return -1;
+  }
+  minorfault();
+  return 0;
+}
+
+// Check that [va, va+n) lies in one mapping of the current
+// process, writable if write is set, and fault in its pages,
+// so the kernel can use it.
+int
+vmaprefault(uint va, uint n, int write)
+{
+  struct vma *v;
+  pte_t *pte;
+  uint a;
+
+  lockvm();
+  if((v = vmalookup(proc->leader, va)) == 0 || va + n > v->end || va + n < va)
+    goto bad;
+  if(write && (v->prot & PROT_WRITE) == 0)
+    goto bad;
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE){
+    pte = walkpgdir(proc->pgdir, (char*)a, 0);
+    if((pte == 0 || (*pte & PTE_P) == 0) && vmafault(a) < 0)
+      goto bad;
+  }
+  unlockvm();
+  return 0;
+
+bad:
+  unlockvm();
+  return -1;
+}
+
+// fetchstr() for strings that live in a mapping.
+int
+vmafetchstr(uint addr, char **pp)
+{
+  struct vma *v;
+  char *s;
+
+  if((v = vmalookup(proc->leader, addr)) == 0)
+    return -1;
+  *pp = (char*)addr;
+  for(s = *pp; s < (char*)v->end; s++){
+    if((s == *pp || (uint)s % PGSIZE == 0) && vmaprefault((uint)s, 1, 0) < 0)
+      return -1;
+    if(*s == 0)
+      return s - *pp;
+  }
+  return -1;
+}
@@ -38,6 +38,9 @@
 #define CR0_PG          0x80000000      // Paging
 
 #define CR4_PSE         0x00000010      // Page size extension
+#define CR4_PGE         0x00000080      // Page global enable
+#define CR4_OSFXSR      0x00000200      // fxsave/fxrstor and SSE enable
+#define CR4_OSXMMEXCPT  0x00000400      // SIMD exceptions raise #XM
 
 #define SEG_KCODE 1  // kernel code
 #define SEG_KDATA 2  // kernel data+stack
@@ -121,6 +124,8 @@ struct segdesc {
 #define NPDENTRIES      1024    // # directory entries per page directory
 #define NPTENTRIES      1024    // # PTEs per page table
 #define PGSIZE          4096    // bytes mapped by a page
+#define SPGSIZE         (PGSIZE*NPTENTRIES) // bytes mapped by a PTE_PS superpage
+#define SPGORDER        (PDXSHIFT-PTXSHIFT) // log2(SPGSIZE/PGSIZE)
 
 #define PGSHIFT         12      // log2(PGSIZE)
 #define PTXSHIFT        12      // offset of PTX in a linear address
@@ -138,15 +143,20 @@ struct segdesc {
 #define PTE_A           0x020   // Accessed
 #define PTE_D           0x040   // Dirty
 #define PTE_PS          0x080   // Page Size
+#define PTE_G           0x100   // Global, kept in TLB across CR3 loads
+#define PTE_SHARED      0x200   // Software: page belongs to a shm segment
+#define PTE_SWAPPED     0x400   // Software: not present, slot in address bits
 #define PTE_MBZ         0x180   // Bits must be zero
 
+// Page fault error code bits
+#define FEC_PR          0x1     // Fault on a present page (protection)
+#define FEC_WR          0x2     // Fault on a write
+
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)   ((uint)(pte) & ~0xFFF)
 #define PTE_FLAGS(pte)  ((uint)(pte) &  0xFFF)
 
 #ifndef __ASSEMBLER__
-typedef uint pte_t;
-
 // Task state segment format
 struct taskstate {
   uint link;         // Old ts selector
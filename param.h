@@ -2,13 +2,23 @@
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NVMA         16  // memory mappings per process
+#define NSHM         16  // shared-memory segments
+#define SHMMAXPAGES 256  // pages per shared-memory segment
+#define SHMNAME      16  // max length of a segment name, including nul
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define NBUF         (LOGSIZE*2+RAMAX+MAXOPBLOCKS)  // minimum size of disk block cache
+#ifndef BCACHEPCT
+#define BCACHEPCT    10  // % of physical memory the block cache may use
+#endif
+#define BCACHEMINFREE 1024  // free pages below which the block cache stops growing
+#define RAMAX        64  // max read-ahead window, in blocks
 #define FSSIZE       1000  // size of file system in blocks
+#define MAXORDER     10  // largest physical block is 2^MAXORDER pages
+#define NSWAPPAGES 4096  // pages of swap space after the file system
+#define HEAPSUPERPAGES 1  // back 4MB-aligned heap growth with 4MB pages
 #define QUANTA 		 5 //process preemption will be done every quanta size (measured inclock ticks) 
@@ -0,0 +1,122 @@
+// PCI bus enumeration, using configuration mechanism #1
+// (I/O ports 0xCF8 and 0xCFC).
+//
+// pciinit() walks every bus, device and function once at boot
+// and records what it finds; drivers then look up their device
+// with pcifind().
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "pci.h"
+
+#define PCI_ADDR  0xcf8
+#define PCI_DATA  0xcfc
+#define NPCIDEV   32
+
+static struct pcidev pcidevs[NPCIDEV];
+static int npcidev;
+
+static uint
+confaddr(int bus, int dev, int func, int off)
+{
+  return 0x80000000 | (bus << 16) | (dev << 11) | (func << 8) | (off & 0xfc);
+}
+
+static uint
+confread(int bus, int dev, int func, int off)
+{
+  outl(PCI_ADDR, confaddr(bus, dev, func, off));
+  return inl(PCI_DATA);
+}
+
+// Read a 32-bit register of d's configuration space.
+uint
+pciread(struct pcidev *d, int off)
+{
+  return confread(d->bus, d->dev, d->func, off);
+}
+
+// Write a 32-bit register of d's configuration space.
+void
+pciwrite(struct pcidev *d, int off, uint v)
+{
+  outl(PCI_ADDR, confaddr(d->bus, d->dev, d->func, off));
+  outl(PCI_DATA, v);
+}
+
+// Record the function at bus/dev/func.
+static void
+pciadd(int bus, int dev, int func, uint id)
+{
+  struct pcidev *d;
+  uint class, bar;
+  int i;
+
+  if(npcidev == NPCIDEV){
+    cprintf("pci: too many devices\n");
+    return;
+  }
+  d = &pcidevs[npcidev++];
+  d->bus = bus;
+  d->dev = dev;
+  d->func = func;
+  d->vendor = id & 0xffff;
+  d->device = id >> 16;
+  class = confread(bus, dev, func, PCI_CLASS);
+  d->class = class >> 24;
+  d->subclass = class >> 16;
+  d->progif = class >> 8;
+  d->irq = confread(bus, dev, func, PCI_INTR);
+  for(i = 0; i < 6; i++){
+    bar = confread(bus, dev, func, PCI_BAR0 + 4*i);
+    d->bar[i] = (bar & PCI_BAR_IO) ? (bar & ~0x3) : (bar & ~0xf);
+  }
+}
+
+void
+pciinit(void)
+{
+  int bus, dev, func, nfunc;
+  uint id;
+
+  for(bus = 0; bus < 256; bus++){
+    for(dev = 0; dev < 32; dev++){
+      if((confread(bus, dev, 0, PCI_ID) & 0xffff) == 0xffff)
+        continue;
+      // Bit 7 of the header type marks a multi-function device.
+      nfunc = (confread(bus, dev, 0, 0x0c) & 0x800000) ? 8 : 1;
+      for(func = 0; func < nfunc; func++){
+        id = confread(bus, dev, func, PCI_ID);
+        if((id & 0xffff) != 0xffff)
+          pciadd(bus, dev, func, id);
+      }
+    }
+  }
+}
+
+// Find a device by vendor and device id, or by class and
+// subclass; -1 matches anything.  Returns 0 if none.
+struct pcidev*
+pcifind(int vendor, int device, int class, int subclass)
+{
+  struct pcidev *d;
+
+  for(d = pcidevs; d < &pcidevs[npcidev]; d++){
+    if((vendor < 0 || d->vendor == vendor) &&
+       (device < 0 || d->device == device) &&
+       (class < 0 || d->class == class) &&
+       (subclass < 0 || d->subclass == subclass))
+      return d;
+  }
+  return 0;
+}
+
+// Let d answer I/O and memory accesses and master the bus.
+void
+pcienable(struct pcidev *d)
+{
+  pciwrite(d, PCI_COMMAND, pciread(d, PCI_COMMAND) |
+           PCI_CMD_IO | PCI_CMD_MEM | PCI_CMD_BUSMASTER);
+}
@@ -0,0 +1,26 @@
+// PCI configuration space.
+
+#define PCI_ID        0x00  // vendor (low 16 bits) and device
+#define PCI_COMMAND   0x04
+#define PCI_CLASS     0x08  // class, subclass, prog if, revision
+#define PCI_BAR0      0x10
+#define PCI_INTR      0x3c  // interrupt line (low 8 bits)
+
+#define PCI_CMD_IO    0x1   // respond to I/O space accesses
+#define PCI_CMD_MEM   0x2   // respond to memory space accesses
+#define PCI_CMD_BUSMASTER 0x4
+
+#define PCI_BAR_IO    0x1   // BAR maps I/O ports, not memory
+
+struct pcidev {
+  uchar bus;
+  uchar dev;
+  uchar func;
+  ushort vendor;
+  ushort device;
+  uchar class;
+  uchar subclass;
+  uchar progif;
+  uchar irq;
+  uint bar[6];    // base addresses, flag bits cleared
+};
@@ -0,0 +1,58 @@
+// Context-switch benchmark: a parent and child bounce one byte
+// back and forth over a pair of pipes.  Every round trip is two
+// sleep/wakeup pairs and two switchuvm() calls, so the time per
+// round trip tracks the cost of a context switch.
+//
+//   pingpong [rounds]
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+int
+main(int argc, char *argv[])
+{
+  int p1[2], p2[2], n, i, pid, start, ticks;
+  char c;
+
+  n = 10000;
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(pipe(p1) < 0 || pipe(p2) < 0){
+    printf(2, "pingpong: pipe failed\n");
+    exit();
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf(2, "pingpong: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    close(p1[1]);
+    close(p2[0]);
+    while(read(p1[0], &c, 1) == 1)
+      write(p2[1], &c, 1);
+    exit();
+  }
+
+  close(p1[0]);
+  close(p2[1]);
+  c = 'x';
+  start = uptime();
+  for(i = 0; i < n; i++){
+    if(write(p1[1], &c, 1) != 1 || read(p2[0], &c, 1) != 1){
+      printf(2, "pingpong: round %d failed\n", i);
+      break;
+    }
+  }
+  ticks = uptime() - start;
+  close(p1[1]);
+  wait();
+
+  printf(1, "pingpong: %d round trips in %d ticks", i, ticks);
+  if(ticks > 0)
+    printf(1, ", %d per tick", i / ticks);
+  printf(1, "\n");
+  exit();
+}
@@ -4,8 +4,9 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "x86.h"
-#include "proc.h"
 #include "spinlock.h"
+#include "proc.h"
+#include "spawn.h"
 #define NULL 0
 
 struct {
@@ -48,10 +49,17 @@ allocproc(void)
 found:
   p->state = EMBRYO;
   p->pid = nextpid++;
+  p->leader = p;
   p->ctime = ticks;
   p->retime = 0;
   p->rutime = 0;
   p->stime = 0;
+  p->pinlo = p->pinhi = 0;
+  initlock(&p->fdlock, "fdtable");
+  p->majflt = 0;
+  p->minflt = 0;
+  p->fpuused = 0;
+  p->fpucpu = 0;
   p->fake[0] = '*';
   p->fake[1] = '*';
   p->fake[2] = '*';
@@ -117,23 +125,180 @@ userinit(void)
   p->state = RUNNABLE;
 }
 
+// Serialize changes to the address space shared by the
+// current thread group: page faults, sbrk, mmap, fork.
+void
+lockvm(void)
+{
+  acquire(&ptable.lock);
+  while(proc->leader->vmbusy)
+    sleep(&proc->leader->vmbusy, &ptable.lock);
+  proc->leader->vmbusy = 1;
+  release(&ptable.lock);
+}
+
+void
+unlockvm(void)
+{
+  acquire(&ptable.lock);
+  proc->leader->vmbusy = 0;
+  wakeup1(&proc->leader->vmbusy);
+  release(&ptable.lock);
+}
+
 // Grow current process's memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
+  struct proc *p;
   uint sz;
 
+  lockvm();
   sz = proc->sz;
+  if(n > 0 && sz + n > vmalow(proc->leader))
+    goto bad;
   if(n > 0){
-    if((sz = allocuvm(proc->pgdir, sz, sz + n)) == 0)
-      return -1;
+    if((sz = growuvm(proc->pgdir, sz, sz + n)) == 0)
+      goto bad;
   } else if(n < 0){
     if((sz = deallocuvm(proc->pgdir, sz, sz + n)) == 0)
-      return -1;
+      goto bad;
   }
-  proc->sz = sz;
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+    if(p->leader == proc->leader && p->state != UNUSED)
+      p->sz = sz;
+  release(&ptable.lock);
   switchuvm(proc);
+  unlockvm();
+  return 0;
+
+bad:
+  unlockvm();
+  return -1;
+}
+
+// Keep [va, va+n) of the current process's memory resident
+// until the system call returns, because the kernel is about
+// to use it directly, perhaps while holding a spinlock.
+// Each thread pins one range, grown to cover every block.
+void
+pinuser(uint va, uint n)
+{
+  acquire(&ptable.lock);
+  if(proc->pinlo == proc->pinhi){
+    proc->pinlo = va;
+    proc->pinhi = va + n;
+  } else {
+    if(va < proc->pinlo)
+      proc->pinlo = va;
+    if(va + n > proc->pinhi)
+      proc->pinhi = va + n;
+  }
+  release(&ptable.lock);
+}
+
+// Drop the current thread's pins, at the end of a system call.
+void
+unpinuser(void)
+{
+  if(proc->pinlo == proc->pinhi)
+    return;
+  acquire(&ptable.lock);
+  proc->pinlo = proc->pinhi = 0;
+  release(&ptable.lock);
+}
+
+// Clock hand for page replacement: a process slot and an
+// address within it, and the range pinned in that process.
+// Protected by ptable.lock.
+static struct {
+  int pi;
+  uint va;
+  uint pinlo, pinhi;
+} hand;
+
+// Can p's pages be taken away right now?  Only if no thread
+// of p is on a CPU (so no CPU has stale TLB entries once we
+// change the PTEs) and nobody is changing its page table.
+// The pages its threads have pinned stay as well; their
+// ranges are merged into hand.pinlo..hand.pinhi.  Pages are
+// scanned through group leaders only.
+// Caller must hold ptable.lock.
+static int
+evictable(struct proc *p)
+{
+  struct proc *q;
+
+  if(p->leader != p || p->pgdir == 0 || p->vmbusy ||
+     p->state == UNUSED || p->state == ZOMBIE)
+    return 0;
+  hand.pinlo = hand.pinhi = 0;
+  for(q = ptable.proc; q < &ptable.proc[NPROC]; q++){
+    if(q->leader != p || q->state == UNUSED || q->state == ZOMBIE)
+      continue;
+    if(q == proc || q->state == RUNNING || q->state == EMBRYO)
+      return 0;
+    if(q->pinlo == q->pinhi)
+      continue;
+    if(hand.pinlo == hand.pinhi || q->pinlo < hand.pinlo)
+      hand.pinlo = q->pinlo;
+    if(q->pinhi > hand.pinhi)
+      hand.pinhi = q->pinhi;
+  }
+  return 1;
+}
+
+// Choose a user page to evict with the clock algorithm:
+// sweep all processes' pages, clearing PTE_A, and take the
+// first page found with PTE_A already clear.  The page's PTE
+// is replaced by a PTE_SWAPPED entry naming slot.  Returns
+// the page, which the caller writes out and frees, or 0 if
+// nothing can be evicted.  Superpages and shm pages stay.
+char*
+clockvictim(uint slot)
+{
+  struct proc *p;
+  pde_t pde;
+  pte_t *pte;
+  char *mem;
+  int wraps, ok;
+
+  acquire(&ptable.lock);
+  ok = evictable(&ptable.proc[hand.pi]);
+  for(wraps = 0; wraps < 3; ){
+    p = &ptable.proc[hand.pi];
+    if(hand.va >= p->sz || !ok){
+      hand.va = 0;
+      if(++hand.pi == NPROC){
+        hand.pi = 0;
+        wraps++;
+      }
+      ok = evictable(&ptable.proc[hand.pi]);
+      continue;
+    }
+    pde = p->pgdir[PDX(hand.va)];
+    if(!(pde & PTE_P) || (pde & PTE_PS)){
+      hand.va = PGADDR(PDX(hand.va) + 1, 0, 0);
+      continue;
+    }
+    pte = (pte_t*)p2v(PTE_ADDR(pde)) + PTX(hand.va);
+    hand.va += PGSIZE;
+    if((*pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U) || (*pte & PTE_SHARED))
+      continue;
+    if(hand.va - PGSIZE < hand.pinhi && hand.va > hand.pinlo)
+      continue;   // the page just passed is pinned
+    if(*pte & PTE_A){
+      *pte &= ~PTE_A;
+      continue;
+    }
+    mem = p2v(PTE_ADDR(*pte));
+    *pte = (slot << PTXSHIFT) | (PTE_FLAGS(*pte) & (PTE_W|PTE_U)) | PTE_SWAPPED;
+    release(&ptable.lock);
+    return mem;
+  }
+  release(&ptable.lock);
   return 0;
 }
 
@@ -151,12 +316,24 @@ fork(void)
     return -1;
 
   // Copy process state from p.
+  lockvm();
   if((np->pgdir = copyuvm(proc->pgdir, proc->sz)) == 0){
+    unlockvm();
     kfree(np->kstack);
     np->kstack = 0;
     np->state = UNUSED;
     return -1;
   }
+  if(vmacopy(np, proc->leader) < 0){
+    unlockvm();
+    freevm(np->pgdir);
+    np->pgdir = 0;
+    kfree(np->kstack);
+    np->kstack = 0;
+    np->state = UNUSED;
+    return -1;
+  }
+  unlockvm();
   np->sz = proc->sz;
   np->parent = proc;
   *np->tf = *proc->tf;
@@ -164,10 +341,13 @@ fork(void)
   // Clear %eax so that fork returns 0 in the child.
   np->tf->eax = 0;
   np->priority = proc->priority;
+  acquire(&proc->leader->fdlock);
   for(i = 0; i < NOFILE; i++)
-    if(proc->ofile[i])
-      np->ofile[i] = filedup(proc->ofile[i]);
-  np->cwd = idup(proc->cwd);
+    if(proc->leader->ofile[i])
+      np->ofile[i] = filedup(proc->leader->ofile[i]);
+  release(&proc->leader->fdlock);
+  np->cwd = idup(proc->leader->cwd);
+  fpufork(np, proc);
 
   safestrcpy(np->name, proc->name, sizeof(proc->name));
 
@@ -181,6 +361,258 @@ fork(void)
   return pid;
 }
 
+// Start the program at path in a new child process, without
+// copying the caller's memory the way fork() does.  The child
+// gets the caller's open files with acts applied to them in
+// order.  Returns the child's pid, or -1.
+int
+spawn(char *path, char **argv, struct spawnact *acts, int nacts)
+{
+  int i, pid;
+  uint sz, sp, entry;
+  pde_t *pgdir;
+  struct file *of[NOFILE];
+  struct proc *np;
+
+  acquire(&proc->leader->fdlock);
+  for(i = 0; i < NOFILE; i++)
+    of[i] = proc->leader->ofile[i] ? filedup(proc->leader->ofile[i]) : 0;
+  release(&proc->leader->fdlock);
+  for(i = 0; i < nacts; i++){
+    if(acts[i].fd < 0 || acts[i].fd >= NOFILE || of[acts[i].fd] == 0)
+      goto bad;
+    switch(acts[i].op){
+    case SPAWN_DUP2:
+      if(acts[i].newfd < 0 || acts[i].newfd >= NOFILE)
+        goto bad;
+      if(acts[i].newfd == acts[i].fd)
+        break;
+      if(of[acts[i].newfd])
+        fileclose(of[acts[i].newfd]);
+      of[acts[i].newfd] = filedup(of[acts[i].fd]);
+      break;
+    case SPAWN_CLOSE:
+      fileclose(of[acts[i].fd]);
+      of[acts[i].fd] = 0;
+      break;
+    default:
+      goto bad;
+    }
+  }
+
+  if(loadimage(path, argv, &pgdir, &sz, &sp, &entry) < 0)
+    goto bad;
+  if((np = allocproc()) == 0){
+    freevm(pgdir);
+    goto bad;
+  }
+
+  np->pgdir = pgdir;
+  np->sz = sz;
+  np->parent = proc;
+  np->priority = proc->priority;
+  #ifdef DML
+  np->priority = 2;
+  #endif
+  memset(np->tf, 0, sizeof(*np->tf));
+  np->tf->cs = (SEG_UCODE << 3) | DPL_USER;
+  np->tf->ds = (SEG_UDATA << 3) | DPL_USER;
+  np->tf->es = np->tf->ds;
+  np->tf->ss = np->tf->ds;
+  np->tf->eflags = FL_IF;
+  np->tf->esp = sp;
+  np->tf->eip = entry;
+  for(i = 0; i < NOFILE; i++)
+    np->ofile[i] = of[i];
+  np->cwd = idup(proc->leader->cwd);
+  safestrcpy(np->name, progname(path), sizeof(np->name));
+
+  pid = np->pid;
+
+  acquire(&ptable.lock);
+  np->state = RUNNABLE;
+  release(&ptable.lock);
+
+  return pid;
+
+ bad:
+  for(i = 0; i < NOFILE; i++)
+    if(of[i])
+      fileclose(of[i]);
+  return -1;
+}
+
+// Create a thread that shares the current process's address
+// space, files and cwd, and starts in fn(arg) on the user stack
+// page at stack.  Returns the new thread's pid, or -1.
+int
+clone(void (*fn)(void*), void *arg, void *stack)
+{
+  struct proc *np;
+  uint sp, ustack[2];
+
+  if((np = allocproc()) == 0)
+    return -1;
+
+  np->pgdir = proc->pgdir;
+  np->sz = proc->sz;
+  np->parent = proc;
+  np->leader = proc->leader;
+  np->ustack = (uint)stack;
+  *np->tf = *proc->tf;
+  np->priority = proc->priority;
+
+  // fn's frame: fake return PC, then arg.
+  sp = (uint)stack + PGSIZE;
+  ustack[0] = 0xffffffff;
+  ustack[1] = (uint)arg;
+  sp -= sizeof(ustack);
+  if(copyout(np->pgdir, sp, ustack, sizeof(ustack)) < 0){
+    kfree(np->kstack);
+    np->kstack = 0;
+    np->state = UNUSED;
+    return -1;
+  }
+  np->tf->esp = sp;
+  np->tf->eip = (uint)fn;
+  fpufork(np, proc);
+  safestrcpy(np->name, proc->name, sizeof(proc->name));
+
+  acquire(&ptable.lock);
+  np->state = RUNNABLE;
+  release(&ptable.lock);
+
+  return np->pid;
+}
+
+// A new kernel thread's first scheduling switches here;
+// the thread's function is the return address above.
+static void
+kthreadstart(void)
+{
+  // Still holding ptable.lock from scheduler.
+  release(&ptable.lock);
+}
+
+// Start a kernel thread running fn(arg).  It has no user
+// memory and never returns to user space; fn must not return.
+struct proc*
+kthreadcreate(void (*fn)(void*), void *arg, char *name)
+{
+  struct proc *p;
+  char *sp;
+
+  if((p = allocproc()) == 0)
+    return 0;
+  if((p->pgdir = setupkvm()) == 0){
+    kfree(p->kstack);
+    p->kstack = 0;
+    p->state = UNUSED;
+    return 0;
+  }
+
+  // Replace allocproc's stack: kthreadstart returns into fn,
+  // which finds a fake return PC and arg above it.
+  sp = p->kstack + KSTACKSIZE;
+  sp -= 4;
+  *(uint*)sp = (uint)arg;
+  sp -= 4;
+  *(uint*)sp = 0;
+  sp -= 4;
+  *(uint*)sp = (uint)fn;
+  sp -= sizeof *p->context;
+  p->context = (struct context*)sp;
+  memset(p->context, 0, sizeof *p->context);
+  p->context->eip = (uint)kthreadstart;
+
+  p->parent = initproc;
+  p->priority = 2;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+  p->state = RUNNABLE;
+  release(&ptable.lock);
+  return p;
+}
+
+// Release an exited thread's proc slot.
+// Caller must hold ptable.lock.
+static void
+freethread(struct proc *p)
+{
+  kfree(p->kstack);
+  p->kstack = 0;
+  p->pgdir = 0;
+  p->state = UNUSED;
+  p->pid = 0;
+  p->parent = 0;
+  p->leader = 0;
+  p->name[0] = 0;
+  p->killed = 0;
+}
+
+// Wait for a thread created by the current thread to exit.
+// Sets *stack to the stack it was given and returns its pid,
+// or returns -1 if there are no such threads.
+int
+join(void **stack)
+{
+  struct proc *p;
+  int havekids, pid;
+
+  acquire(&ptable.lock);
+  for(;;){
+    havekids = 0;
+    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+      if(p->parent != proc || p->leader == p)
+        continue;
+      havekids = 1;
+      if(p->state == ZOMBIE){
+        pid = p->pid;
+        *stack = (void*)p->ustack;
+        freethread(p);
+        release(&ptable.lock);
+        return pid;
+      }
+    }
+    if(!havekids || proc->killed){
+      release(&ptable.lock);
+      return -1;
+    }
+    sleep(proc, &ptable.lock);
+  }
+}
+
+// Kill the other threads of the current process and wait for
+// them to exit.  Caller must be the group leader.
+void
+killthreads(void)
+{
+  struct proc *p;
+  int n;
+
+  acquire(&ptable.lock);
+  for(;;){
+    n = 0;
+    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+      if(p == proc || p->leader != proc || p->state == UNUSED)
+        continue;
+      if(p->state == ZOMBIE){
+        freethread(p);
+        continue;
+      }
+      n++;
+      p->killed = 1;
+      if(p->state == SLEEPING)
+        p->state = RUNNABLE;
+    }
+    if(n == 0)
+      break;
+    sleep(proc, &ptable.lock);
+  }
+  release(&ptable.lock);
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait() to find out it exited.
@@ -193,27 +625,44 @@ exit(void)
   if(proc == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(fd = 0; fd < NOFILE; fd++){
-    if(proc->ofile[fd]){
-      fileclose(proc->ofile[fd]);
-      proc->ofile[fd] = 0;
+  if(proc->leader == proc){
+    // The whole process goes: threads first, since they
+    // use its memory and files.
+    killthreads();
+
+    // Write back shared mappings, then close all open files.
+    vmaexit(proc);
+    for(fd = 0; fd < NOFILE; fd++){
+      if(proc->ofile[fd]){
+        fileclose(proc->ofile[fd]);
+        proc->ofile[fd] = 0;
+      }
     }
-  }
 
-  begin_op();
-  iput(proc->cwd);
-  end_op();
-  proc->cwd = 0;
+    begin_op();
+    iput(proc->cwd);
+    end_op();
+    proc->cwd = 0;
+  }
 
   acquire(&ptable.lock);
 
-  // Parent might be sleeping in wait().
+  // Parent might be sleeping in wait() or join(), and
+  // the leader in killthreads().
   wakeup1(proc->parent);
+  if(proc->leader != proc)
+    wakeup1(proc->leader);
 
-  // Pass abandoned children to init.
+  // Pass abandoned children to init, and abandoned
+  // threads to their leader.
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
     if(p->parent == proc){
+      if(p->leader != p && p->leader != proc){
+        p->parent = p->leader;
+        if(p->state == ZOMBIE)
+          wakeup1(p->leader);
+        continue;
+      }
       p->parent = initproc;
       if(p->state == ZOMBIE)
         wakeup1(initproc);
@@ -238,7 +687,7 @@ wait(void)
     // Scan through table looking for zombie children.
     havekids = 0;
     for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->parent != proc)
+      if(p->parent != proc || p->leader != p)
         continue;
       havekids = 1;
       if(p->state == ZOMBIE){
@@ -276,7 +725,7 @@ int wait2(int *retime, int *rutime, int *stime) {
     // Scan through table looking for zombie children.
     havekids = 0;
     for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->parent != proc)
+      if(p->parent != proc || p->leader != p)
         continue;
       havekids = 1;
       if(p->state == ZOMBIE){
@@ -410,6 +859,7 @@ void
 scheduler(void)
 {
   struct proc *p;
+  int idle;
   int index1 = 0;
   int index2 = 0;
   int index3 = 0;
@@ -425,6 +875,7 @@ scheduler(void)
 
     // Loop over process table looking for process to run.
     acquire(&ptable.lock);
+    idle = 1;
 
 
     // the differnt options for scheduling policies, chosen during compilation
@@ -436,6 +887,7 @@ scheduler(void)
       // Switch to chosen process.  It is the process's job
       // to release ptable.lock and then reacquire it
       // before jumping back to us.
+      idle = 0;
       proc = p;
       switchuvm(p);
       p->state = RUNNING;
@@ -463,6 +915,7 @@ scheduler(void)
         }
         if (minP!=NULL){
           p = minP;//the process with the smallest creation time
+          idle = 0;
           proc = p;
           switchuvm(p);
           p->state = RUNNING;
@@ -479,8 +932,10 @@ scheduler(void)
     p = findreadyprocess(&index1, &index2, &index3, &priority);
     if (p == 0) {
       release(&ptable.lock);
+      kzerofill(); // nothing to run: pre-zero free pages meanwhile
       continue;
     }
+    idle = 0;
     proc = p;
     switchuvm(p);
     p->state = RUNNING;
@@ -494,8 +949,10 @@ scheduler(void)
     p = findreadyprocess(&index1, &index2, &index3, &priority);
     if (p == 0) {
       release(&ptable.lock);
+      kzerofill(); // nothing to run: pre-zero free pages meanwhile
       continue;
     }
+    idle = 0;
     proc = p;
     switchuvm(p);
     p->state = RUNNING;
@@ -508,6 +965,8 @@ scheduler(void)
     #endif
     #endif
     release(&ptable.lock);
+    if(idle)
+      kzerofill(); // nothing to run: pre-zero free pages meanwhile
   }
 }
 
@@ -527,6 +986,7 @@ sched(void)
   if(readeflags()&FL_IF)
     panic("sched interruptible");
   intena = cpu->intena;
+  fpusave();
   swtch(&proc->context, cpu->scheduler);
   cpu->intena = intena;
 }
@@ -557,6 +1017,7 @@ forkret(void)
     first = 0;
     iinit(ROOTDEV);
     initlog(ROOTDEV);
+    swapinit(ROOTDEV);
   }
 
   // Return to "caller", actually trapret (see allocproc).
@@ -625,6 +1086,28 @@ wakeup(void *chan)
   release(&ptable.lock);
 }
 
+// Wake up at most n processes sleeping on chan.
+// Returns the number woken.
+int
+wakeupn(void *chan, int n)
+{
+  struct proc *p;
+  int woken;
+
+  woken = 0;
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC] && woken < n; p++)
+    if(p->state == SLEEPING && p->chan == chan) {
+      p->state = RUNNABLE;
+      #ifdef DML
+      p->priority = 3;
+      #endif
+      woken++;
+    }
+  release(&ptable.lock);
+  return woken;
+}
+
 // Kill the process with the given pid.
 // Process won't exit until it returns
 // to user space (see trap in trap.c).
@@ -675,7 +1158,7 @@ procdump(void)
       state = states[p->state];
     else
       state = "???";
-    cprintf("%d %s %s", p->pid, state, p->name);
+    cprintf("%d %s %s flt %d/%d", p->pid, state, p->name, p->majflt, p->minflt);
     if(p->state == SLEEPING){
       getcallerpcs((uint*)p->context->ebp+2, pc);
       for(i=0; i<10 && pc[i] != 0; i++)
@@ -10,6 +10,8 @@ struct cpu {
   volatile uint started;       // Has the CPU started?
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
+  struct proc *fpuowner;       // Whose FPU state is in the registers
+  volatile int tlbflush;       // tlbshootdown() waits for us to flush
 
   // Cpu-local storage variables; see below
   struct cpu *cpu;
@@ -49,6 +51,17 @@ struct context {
   uint eip;
 };
 
+// A region of memory created by mmap().
+struct vma {
+  uint start;                  // First address; page aligned
+  uint end;                    // One past the last byte; 0 if slot unused
+  int prot;                    // PROT_READ, PROT_WRITE
+  int flags;                   // MAP_SHARED or MAP_PRIVATE, MAP_ANONYMOUS
+  struct file *f;              // Mapped file, or 0 if anonymous
+  uint off;                    // File offset of start
+  struct shmseg *shm;          // Attached shm segment, or 0
+};
+
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -60,12 +73,24 @@ struct proc {
   char *kstack;                // Bottom of kernel stack for this process
   enum procstate state;        // Process state
   struct proc *parent;         // Parent process
+  struct proc *leader;         // Thread group leader; self for a process
   struct trapframe *tf;        // Trap frame for current syscall
   struct context *context;     // swtch() here to run process
   void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
-  struct file *ofile[NOFILE];  // Open files
-  struct inode *cwd;           // Current directory
+  struct spinlock fdlock;      // Leader: protects ofile[]
+  struct file *ofile[NOFILE];  // Open files (leader's are shared)
+  struct inode *cwd;           // Current directory (leader's is shared)
+  struct vma vma[NVMA];        // Memory mappings (leader's are shared)
+  int vmbusy;                  // Leader: address space being changed
+  uint ustack;                 // Thread: user stack passed to clone()
+  uint pinlo, pinhi;           // User memory the kernel is using; see pinuser()
+  uint logseq;                 // Log transaction this FS call wrote to, or 0
+  uint majflt;                 // Page faults that read from swap
+  uint minflt;                 // Page faults served from memory
+  int fpuused;                 // fpu holds state; else FPU not used yet
+  struct cpu *fpucpu;          // CPU that last loaded fpu into registers
+  uchar fpu[512] __attribute__((aligned(16)));  // FXSAVE area
   uint ctime;                   // Process creation time
   int stime;                   //process SLEEPING time
   int retime;                  //process READY(RUNNABLE) time
@@ -75,10 +100,16 @@ struct proc {
   char fake[8];
 };
 
+// Threads made by clone() are procs that share their leader's
+// pgdir, open files, cwd and mappings, and use leader->ofile etc.
+// They have their own kernel stack, trapframe and user stack.
+
 // Process memory is laid out contiguously, low addresses first:
 //   text
 //   original data and bss
 //   fixed-size stack
 //   expandable heap
+//   ...
+//   mmap() regions, growing down from KERNBASE
 
 void updatestatistics();
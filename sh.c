@@ -3,6 +3,7 @@
 #include "types.h"
 #include "user.h"
 #include "fcntl.h"
+#include "spawn.h"
 
 // Parsed command representation
 #define EXEC  1
@@ -55,7 +56,10 @@ struct backcmd {
 
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
+void runcmd(struct cmd*) __attribute__((noreturn));
 struct cmd *parsecmd(char*);
+void freecmd(struct cmd*);
+char *parseerr;  // first syntax error in the last parsecmd(), or 0
 
  char cmdFromHistory[INPUT_BUF];//this is the buffer that will get the current history command from history
 
@@ -152,6 +156,94 @@ runcmd(struct cmd *cmd)
   exit();
 }
 
+// Can cmd be started with spawn() from the shell itself?
+// True for simple commands, redirections and pipelines.
+int
+spawnable(struct cmd *cmd)
+{
+  struct pipecmd *pcmd;
+
+  if(cmd == 0)
+    return 0;
+  switch(cmd->type){
+  case EXEC:
+    return ((struct execcmd*)cmd)->argv[0] != 0;
+  case REDIR:
+    return spawnable(((struct redircmd*)cmd)->cmd);
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    return spawnable(pcmd->left) && spawnable(pcmd->right);
+  }
+  return 0;
+}
+
+// Start a spawnable cmd without forking the shell.  The file
+// descriptor changes runcmd() would make in the child become
+// spawn actions, appended to acts[0..nacts-1].
+// Returns the number of processes started.
+int
+spawnrun(struct cmd *cmd, struct spawnact *acts, int nacts)
+{
+  int p[2], fd, n;
+  struct execcmd *ecmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  switch(cmd->type){
+  case EXEC:
+    ecmd = (struct execcmd*)cmd;
+    if(spawn(ecmd->argv[0], ecmd->argv, acts, nacts) < 0){
+      printf(2, "exec %s failed\n", ecmd->argv[0]);
+      return 0;
+    }
+    return 1;
+
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    if(nacts + 2 > SPAWNMAXACT){
+      printf(2, "too many redirections\n");
+      return 0;
+    }
+    if((fd = open(rcmd->file, rcmd->mode)) < 0){
+      printf(2, "open %s failed\n", rcmd->file);
+      return 0;
+    }
+    acts[nacts].op = SPAWN_DUP2;
+    acts[nacts].fd = fd;
+    acts[nacts].newfd = rcmd->fd;
+    acts[nacts+1].op = SPAWN_CLOSE;
+    acts[nacts+1].fd = fd;
+    n = spawnrun(rcmd->cmd, acts, fd == rcmd->fd ? nacts : nacts+2);
+    close(fd);
+    return n;
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    if(nacts + 3 > SPAWNMAXACT){
+      printf(2, "pipeline too long\n");
+      return 0;
+    }
+    if(pipe(p) < 0)
+      panic("pipe");
+    acts[nacts].op = SPAWN_DUP2;
+    acts[nacts].fd = p[1];
+    acts[nacts].newfd = 1;
+    acts[nacts+1].op = SPAWN_CLOSE;
+    acts[nacts+1].fd = p[0];
+    acts[nacts+2].op = SPAWN_CLOSE;
+    acts[nacts+2].fd = p[1];
+    n = spawnrun(pcmd->left, acts, nacts+3);
+    acts[nacts].fd = p[0];
+    acts[nacts].newfd = 0;
+    n += spawnrun(pcmd->right, acts, nacts+3);
+    close(p[0]);
+    close(p[1]);
+    return n;
+  }
+  panic("spawnrun");
+  return 0;
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
@@ -184,7 +276,9 @@ main(void)
   #endif
 
   static char buf[INPUT_BUF];
-  int fd;
+  struct spawnact acts[SPAWNMAXACT];
+  struct cmd *cmd;
+  int fd, n;
   // int retime, rutime, stime,pid;
   // Assumes three file descriptors open.
   while((fd = open("console", O_RDWR)) >= 0){
@@ -214,13 +308,24 @@ main(void)
       printf(1, "Process ID: %d\n", getpid());
       continue;
     }
-  if(fork1() == 0)
-      runcmd(parsecmd(buf));
-  else {
-    wait();
-    // pid = wait2(&retime, &rutime, &stime);
-    // printf(1, "pid:%d retime:%d rutime%d stime:%d\n", pid, retime, rutime, stime);
-  }
+    cmd = parsecmd(buf);
+    if(parseerr){
+      printf(2, "%s\n", parseerr);
+      freecmd(cmd);
+      continue;
+    }
+    if(spawnable(cmd)){
+      // Simple commands and pipelines: no need to copy the shell.
+      for(n = spawnrun(cmd, acts, 0); n > 0; n--)
+        wait();
+    } else if(fork1() == 0)
+      runcmd(cmd);
+    else {
+      wait();
+      // pid = wait2(&retime, &rutime, &stime);
+      // printf(1, "pid:%d retime:%d rutime%d stime:%d\n", pid, retime, rutime, stime);
+    }
+    freecmd(cmd);
   }
   exit();
 }
@@ -310,6 +415,31 @@ backcmd(struct cmd *subcmd)
   cmd->cmd = subcmd;
   return (struct cmd*)cmd;
 }
+// Free a command tree built by parsecmd().
+void
+freecmd(struct cmd *cmd)
+{
+  if(cmd == 0)
+    return;
+  switch(cmd->type){
+  case REDIR:
+    freecmd(((struct redircmd*)cmd)->cmd);
+    break;
+  case PIPE:
+    freecmd(((struct pipecmd*)cmd)->left);
+    freecmd(((struct pipecmd*)cmd)->right);
+    break;
+  case LIST:
+    freecmd(((struct listcmd*)cmd)->left);
+    freecmd(((struct listcmd*)cmd)->right);
+    break;
+  case BACK:
+    freecmd(((struct backcmd*)cmd)->cmd);
+    break;
+  }
+  free(cmd);
+}
+
 //PAGEBREAK!
 // Parsing
 
@@ -378,18 +508,28 @@ struct cmd *parsepipe(char**, char*);
 struct cmd *parseexec(char**, char*);
 struct cmd *nulterminate(struct cmd*);
 
+// Record a syntax error.  Parsing happens in the shell
+// itself, so errors must not exit.
+void
+syntax(char *msg)
+{
+  if(parseerr == 0)
+    parseerr = msg;
+}
+
 struct cmd*
 parsecmd(char *s)
 {
   char *es;
   struct cmd *cmd;
 
+  parseerr = 0;
   es = s + strlen(s);
   cmd = parseline(&s, es);
   peek(&s, es, "");
-  if(s != es){
+  if(s != es && parseerr == 0){
     printf(2, "leftovers: %s\n", s);
-    panic("syntax");
+    syntax("syntax");
   }
   nulterminate(cmd);
   return cmd;
@@ -433,8 +573,10 @@ parseredirs(struct cmd *cmd, char **ps, char *es)
 
   while(peek(ps, es, "<>")){
     tok = gettoken(ps, es, 0, 0);
-    if(gettoken(ps, es, &q, &eq) != 'a')
-      panic("missing file for redirection");
+    if(gettoken(ps, es, &q, &eq) != 'a'){
+      syntax("missing file for redirection");
+      break;
+    }
     switch(tok){
     case '<':
       cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
@@ -455,12 +597,16 @@ parseblock(char **ps, char *es)
 {
   struct cmd *cmd;
 
-  if(!peek(ps, es, "("))
-    panic("parseblock");
+  if(!peek(ps, es, "(")){
+    syntax("parseblock");
+    return 0;
+  }
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
-  if(!peek(ps, es, ")"))
-    panic("syntax - missing )");
+  if(!peek(ps, es, ")")){
+    syntax("syntax - missing )");
+    return cmd;
+  }
   gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
   return cmd;
@@ -485,13 +631,17 @@ parseexec(char **ps, char *es)
   while(!peek(ps, es, "|)&;")){
     if((tok=gettoken(ps, es, &q, &eq)) == 0)
       break;
-    if(tok != 'a')
-      panic("syntax");
+    if(tok != 'a'){
+      syntax("syntax");
+      break;
+    }
+    if(argc + 1 >= MAXARGS){
+      syntax("too many args");
+      break;
+    }
     cmd->argv[argc] = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if(argc >= MAXARGS)
-      panic("too many args");
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc] = 0;
@@ -0,0 +1,209 @@
+// Named shared-memory segments.
+//
+// shmget(name, size) finds or creates a segment; shmat(id) maps
+// the segment's pages into the calling process as an mmap()-style
+// region; shmdt(addr) removes it.  Every process that attaches
+// maps the same physical pages, so data moves between them
+// without going through the kernel.
+//
+// Pages are allocated on the first attach and freed when the last
+// attachment goes away (shmdt or exit).  fork() gives the child
+// its own attachment.  The PTEs carry PTE_SHARED so that freeing
+// a page table does not free segment pages.
+//
+// A slot that nobody has attached can be recycled, possibly
+// between a shmget() and its shmat().  So an id also carries the
+// slot's generation, which changes each time the slot is reused,
+// and shmat() refuses an id whose segment has gone.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "mman.h"
+
+struct shmseg {
+  char name[SHMNAME];
+  uint npages;
+  int ref;                     // # attachments
+  uint gen;                    // bumped when the slot is reused
+  char *pages[SHMMAXPAGES];    // 0 until first attach
+};
+
+struct {
+  struct spinlock lock;
+  struct shmseg seg[NSHM];
+} shm;
+
+#define SHMNGEN    (0x7fffffff / NSHM)   // keeps ids positive
+#define SHMID(s)   ((s)->gen * NSHM + ((s) - shm.seg))
+
+void
+shminit(void)
+{
+  initlock(&shm.lock, "shm");
+}
+
+// Free s's pages.  Caller must hold shm.lock and s->ref must be 0.
+static void
+shmfree(struct shmseg *s)
+{
+  uint i;
+
+  for(i = 0; i < s->npages; i++){
+    if(s->pages[i])
+      kfree(s->pages[i]);
+    s->pages[i] = 0;
+  }
+  s->name[0] = 0;
+  s->npages = 0;
+}
+
+// Return the id of the segment called name, creating it with
+// size bytes if it does not exist.  Returns -1 if size is too
+// large for the existing segment or the table is full.
+int
+shmget(char *name, uint size)
+{
+  struct shmseg *s, *free;
+  uint n;
+
+  n = PGROUNDUP(size) / PGSIZE;
+  if(name[0] == 0 || n == 0 || size > SHMMAXPAGES*PGSIZE)
+    return -1;
+
+  acquire(&shm.lock);
+  free = 0;
+  for(s = shm.seg; s < &shm.seg[NSHM]; s++){
+    if(s->name[0] && strncmp(s->name, name, SHMNAME) == 0){
+      release(&shm.lock);
+      return n <= s->npages ? SHMID(s) : -1;
+    }
+    // Prefer an empty slot; an unattached segment is
+    // recycled only if there is none.
+    if(s->ref == 0 && (free == 0 || (free->name[0] && s->name[0] == 0)))
+      free = s;
+  }
+  if(free == 0){
+    release(&shm.lock);
+    return -1;
+  }
+  if(free->name[0])
+    shmfree(free);
+  safestrcpy(free->name, name, SHMNAME);
+  free->npages = n;
+  free->gen = (free->gen + 1) % SHMNGEN;
+  release(&shm.lock);
+  return SHMID(free);
+}
+
+// Attach segment id to the current process.
+// Returns the address of the mapping, or -1.
+int
+shmat(int id)
+{
+  struct shmseg *s;
+  struct vma *v;
+  uint i;
+
+  if(id < 0)
+    return -1;
+  s = &shm.seg[id % NSHM];
+
+  acquire(&shm.lock);
+  if(s->name[0] == 0 || s->gen != id / NSHM){
+    release(&shm.lock);
+    return -1;
+  }
+  if(s->ref == 0){
+    for(i = 0; i < s->npages; i++){
+      if((s->pages[i] = kzalloc()) == 0){
+        shmfree(s);
+        release(&shm.lock);
+        return -1;
+      }
+    }
+  }
+  s->ref++;
+  release(&shm.lock);
+
+  lockvm();
+  if((v = vmaalloc(s->npages * PGSIZE)) == 0){
+    unlockvm();
+    goto bad;
+  }
+  v->prot = PROT_READ|PROT_WRITE;
+  v->flags = MAP_SHARED;
+  v->shm = s;
+  for(i = 0; i < s->npages; i++){
+    if(mappages(proc->pgdir, (char*)v->start + i*PGSIZE, PGSIZE,
+                v2p(s->pages[i]), PTE_W|PTE_U|PTE_SHARED) < 0){
+      shmunmap(proc->pgdir, v);
+      memset(v, 0, sizeof(*v));
+      unlockvm();
+      goto bad;
+    }
+  }
+  unlockvm();
+  return v->start;
+
+bad:
+  shmrelease(s);
+  return -1;
+}
+
+// Detach the segment mapped at va from the current process.
+int
+shmdt(uint va)
+{
+  struct vma *v;
+  struct shmseg *s;
+
+  lockvm();
+  if((v = vmalookup(proc->leader, va)) == 0 || v->shm == 0 || v->start != va){
+    unlockvm();
+    return -1;
+  }
+  s = v->shm;
+  shmunmap(proc->pgdir, v);
+  memset(v, 0, sizeof(*v));
+  switchuvm(proc);
+  tlbshootdown();  // before shmrelease() can free the pages
+  unlockvm();
+  shmrelease(s);
+  return 0;
+}
+
+// Clear the PTEs of shm mapping v, leaving the pages alone.
+void
+shmunmap(pde_t *pgdir, struct vma *v)
+{
+  pte_t *pte;
+  uint a;
+
+  for(a = v->start; a < v->end; a += PGSIZE)
+    if((pte = walkpgdir(pgdir, (char*)a, 0)) != 0)
+      *pte = 0;
+}
+
+// Take another reference to s, for a forked child.
+void
+shmdup(struct shmseg *s)
+{
+  acquire(&shm.lock);
+  s->ref++;
+  release(&shm.lock);
+}
+
+// Drop a reference to s, freeing its pages on the last one.
+void
+shmrelease(struct shmseg *s)
+{
+  acquire(&shm.lock);
+  if(--s->ref == 0)
+    shmfree(s);
+  release(&shm.lock);
+}
@@ -0,0 +1,324 @@
+// Slab allocator for small kernel objects.
+//
+// A cache (struct kmcache) hands out objects of one fixed size.
+// It gets whole pages from kalloc() and carves each page (a slab)
+// into a header followed by as many objects as fit.  The header
+// keeps a stack of the indexes of free objects, so free objects
+// are never written to and keep whatever state the cache's
+// constructor put in them.
+//
+// Interface:
+// * kmcache_create(name, size, ctor) makes a cache.  If ctor is
+//     non-zero it runs once on every object when its slab is
+//     created; callers must hand objects back in that state.
+// * kmcache_alloc(c) / kmcache_free(c, obj) get and return objects.
+// * kmcache_allocdirect(c) / kmcache_freedirect(c, obj) skip the
+//     per-CPU stacks, and hand a page back to kalloc() as soon as
+//     its slab is empty, for callers that shrink a cache on demand.
+// * kmalloc(n) / kmfree(p) serve general requests of up to
+//     KMALLOCMAX bytes from power-of-two size classes.
+//
+// Each CPU keeps a small stack of free objects per cache.  Most
+// allocations and frees only touch that stack with interrupts
+// off, and take the cache lock just to move a batch of objects
+// between the stack and the slabs.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "proc.h"
+
+#define NKMCACHE   24   // maximum number of caches
+#define NCPUOBJ    16   // free objects cached per CPU
+#define KMALLOCMIN 16   // smallest kmalloc size class
+#define KMALLOCMAX 2048 // largest kmalloc size class
+
+struct slab {
+  struct slab *next;      // next slab in cache's partial or full list
+  struct kmcache *cache;  // owning cache
+  uint nfree;             // # free objects in this slab
+  char *objs;             // first object
+  uchar free[];           // indexes of free objects, nfree on top
+};
+
+struct kmcache {
+  char *name;
+  uint size;              // object size, rounded up for alignment
+  uint perslab;           // objects per slab
+  void (*ctor)(void*);
+  struct spinlock lock;
+  struct slab *partial;   // slabs with at least one free object
+  struct slab *full;      // slabs with no free objects
+  uint nslab;             // pages owned by this cache
+  struct {
+    uint n;
+    void *obj[NCPUOBJ];
+  } cpu[NCPU];
+};
+
+static struct {
+  struct spinlock lock;
+  struct kmcache cache[NKMCACHE];
+  int ncache;
+  struct kmcache *kmalloc[8];  // size classes KMALLOCMIN..KMALLOCMAX
+} slabs;
+
+static char *kmallocnames[] = {
+  "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+  "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+
+void
+slabinit(void)
+{
+  int i;
+
+  initlock(&slabs.lock, "slabs");
+  for(i = 0; i < NELEM(slabs.kmalloc); i++)
+    slabs.kmalloc[i] = kmcache_create(kmallocnames[i], KMALLOCMIN << i, 0);
+}
+
+// Create a cache of objects of the given size.
+struct kmcache*
+kmcache_create(char *name, uint size, void (*ctor)(void*))
+{
+  struct kmcache *c;
+  uint hdr;
+
+  // Keep objects 8-byte aligned.  The first object of a slab
+  // is 16-byte aligned, so objects whose size is a multiple of
+  // 16 (such as every kmalloc size class) stay 16-byte aligned.
+  size = (size + 7) & ~7;
+  if(size < 8 || size > PGSIZE/2)
+    panic("kmcache_create: size");
+
+  acquire(&slabs.lock);
+  if(slabs.ncache == NKMCACHE)
+    panic("kmcache_create: too many caches");
+  c = &slabs.cache[slabs.ncache++];
+  release(&slabs.lock);
+
+  memset(c, 0, sizeof(*c));
+  c->name = name;
+  c->size = size;
+  c->ctor = ctor;
+  initlock(&c->lock, name);
+  for(c->perslab = PGSIZE / size; ; c->perslab--){
+    hdr = (sizeof(struct slab) + c->perslab + 15) & ~15;
+    if(c->perslab <= 255 && hdr + c->perslab * size <= PGSIZE)
+      break;
+  }
+  return c;
+}
+
+// Allocate and construct a new slab for c.
+// Caller must hold c->lock.
+static struct slab*
+slabgrow(struct kmcache *c)
+{
+  struct slab *s;
+  uint i;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->nfree = c->perslab;
+  s->objs = (char*)s + ((sizeof(struct slab) + c->perslab + 15) & ~15);
+  for(i = 0; i < c->perslab; i++){
+    s->free[i] = c->perslab - 1 - i;
+    if(c->ctor)
+      c->ctor(s->objs + i * c->size);
+  }
+  s->next = c->partial;
+  c->partial = s;
+  c->nslab++;
+  return s;
+}
+
+// Take one free object out of c's slabs.
+// Caller must hold c->lock.
+static void*
+slabget(struct kmcache *c)
+{
+  struct slab *s;
+  void *obj;
+
+  if((s = c->partial) == 0 && (s = slabgrow(c)) == 0)
+    return 0;
+  obj = s->objs + s->free[--s->nfree] * c->size;
+  if(s->nfree == 0){
+    c->partial = s->next;
+    s->next = c->full;
+    c->full = s;
+  }
+  return obj;
+}
+
+static void
+slabunlink(struct slab **list, struct slab *s)
+{
+  for(; *list; list = &(*list)->next){
+    if(*list == s){
+      *list = s->next;
+      return;
+    }
+  }
+  panic("slabunlink");
+}
+
+// Return obj to its slab, and the slab's page to kalloc
+// if the slab is now empty and either keep is 0 or the
+// cache has other partial slabs.
+// Caller must hold c->lock.
+static void
+slabput(struct kmcache *c, void *obj, int keep)
+{
+  struct slab *s;
+
+  s = (struct slab*)PGROUNDDOWN((uint)obj);
+  if(s->cache != c)
+    panic("kmcache_free: wrong cache");
+  if(s->nfree == 0){
+    slabunlink(&c->full, s);
+    s->next = c->partial;
+    c->partial = s;
+  }
+  s->free[s->nfree++] = ((char*)obj - s->objs) / c->size;
+  if(s->nfree == c->perslab && (!keep || c->partial != s || s->next)){
+    slabunlink(&c->partial, s);
+    c->nslab--;
+    kfree((char*)s);
+  }
+}
+
+// Allocate an object from cache c.
+// Returns 0 if the memory cannot be allocated.
+void*
+kmcache_alloc(struct kmcache *c)
+{
+  void *obj;
+  int i, n;
+
+  pushcli();
+  n = c->cpu[cpu - cpus].n;
+  if(n > 0){
+    obj = c->cpu[cpu - cpus].obj[--n];
+    c->cpu[cpu - cpus].n = n;
+    popcli();
+    return obj;
+  }
+  popcli();
+
+  // Refill this CPU's stack with half a batch.
+  acquire(&c->lock);
+  obj = slabget(c);
+  n = c->cpu[cpu - cpus].n;
+  for(i = 0; obj && i < NCPUOBJ/2 && n < NCPUOBJ; i++){
+    void *o = slabget(c);
+    if(o == 0)
+      break;
+    c->cpu[cpu - cpus].obj[n++] = o;
+  }
+  c->cpu[cpu - cpus].n = n;
+  release(&c->lock);
+  return obj;
+}
+
+// Return obj to cache c.
+void
+kmcache_free(struct kmcache *c, void *obj)
+{
+  int n;
+
+  pushcli();
+  n = c->cpu[cpu - cpus].n;
+  if(n < NCPUOBJ){
+    c->cpu[cpu - cpus].obj[n] = obj;
+    c->cpu[cpu - cpus].n = n + 1;
+    popcli();
+    return;
+  }
+  popcli();
+
+  // Stack is full; give obj and half the stack back to the slabs.
+  acquire(&c->lock);
+  slabput(c, obj, 1);
+  n = c->cpu[cpu - cpus].n;
+  while(n > NCPUOBJ/2)
+    slabput(c, c->cpu[cpu - cpus].obj[--n], 1);
+  c->cpu[cpu - cpus].n = n;
+  release(&c->lock);
+}
+
+// Allocate an object from c's slabs, not this CPU's stack.
+// Returns 0 if the memory cannot be allocated.
+void*
+kmcache_allocdirect(struct kmcache *c)
+{
+  void *obj;
+
+  acquire(&c->lock);
+  obj = slabget(c);
+  release(&c->lock);
+  return obj;
+}
+
+// Return obj straight to its slab, freeing the slab's
+// page if it is now empty.
+void
+kmcache_freedirect(struct kmcache *c, void *obj)
+{
+  acquire(&c->lock);
+  slabput(c, obj, 0);
+  release(&c->lock);
+}
+
+// Allocate n bytes from the smallest size class that fits.
+// Returns 0 if the memory cannot be allocated.
+void*
+kmalloc(uint n)
+{
+  int i;
+
+  if(n > KMALLOCMAX)
+    panic("kmalloc: too big");
+  for(i = 0; (KMALLOCMIN << i) < n; i++)
+    ;
+  return kmcache_alloc(slabs.kmalloc[i]);
+}
+
+// Free memory returned by kmalloc() or kmcache_alloc().
+void
+kmfree(void *p)
+{
+  struct slab *s;
+
+  s = (struct slab*)PGROUNDDOWN((uint)p);
+  kmcache_free(s->cache, p);
+}
+
+// Pages currently owned by cache c.
+uint
+kmcache_pages(struct kmcache *c)
+{
+  uint n;
+
+  acquire(&c->lock);
+  n = c->nslab;
+  release(&c->lock);
+  return n;
+}
+
+// Print per-cache usage to the console.
+void
+slabdump(void)
+{
+  struct kmcache *c;
+
+  for(c = slabs.cache; c < &slabs.cache[slabs.ncache]; c++)
+    if(c->nslab)
+      cprintf("%s: size %d slabs %d\n", c->name, c->size, c->nslab);
+}
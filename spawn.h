@@ -0,0 +1,12 @@
+// File actions for spawn(), applied in order to the child's
+// copy of the caller's open files before the program starts.
+#define SPAWN_DUP2   1  // make newfd refer to fd's file
+#define SPAWN_CLOSE  2  // close fd
+
+#define SPAWNMAXACT  16 // most actions per spawn()
+
+struct spawnact {
+  int op;
+  int fd;
+  int newfd;  // SPAWN_DUP2 only
+};
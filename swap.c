@@ -0,0 +1,255 @@
+// Swapping user pages to disk.
+//
+// mkfs reserves sb.nswap page-sized slots after the file system,
+// starting at block sb.swapstart.  Slot I/O goes straight to the
+// disk driver through a private buf, bypassing the buffer cache.
+//
+// When ualloc() finds memory full it calls swapout(), which asks
+// clockvictim() in proc.c for a page to evict.  A swapped-out page
+// keeps its slot number and permissions in a non-present PTE
+// marked PTE_SWAPPED; touching it faults into swapfault(), which
+// reads it back.  Faults that need swap I/O count as major, faults
+// served from memory (mmap() fill-ins) as minor.
+//
+// A slot is FREE, USED (holds a page), BUSY (being written out;
+// the page may not be read back yet) or ORPHANED (the PTE went
+// away while it was BUSY; swapout() frees it when done).
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "buf.h"
+
+enum { SLOT_FREE, SLOT_USED, SLOT_BUSY, SLOT_ORPHANED };
+
+struct {
+  struct spinlock lock;
+  uint dev;
+  uint start;                  // first swap block
+  uint nslot;                  // 0 if no swap space
+  uchar state[NSWAPPAGES];
+  uint nused;
+  uint majflt;                 // system-wide fault counts
+  uint minflt;
+  uint nout;                   // pages written to swap
+} swap;
+
+extern struct superblock sb;
+
+// Must run in process context, after iinit().
+void
+swapinit(int dev)
+{
+  initlock(&swap.lock, "swap");
+  swap.dev = dev;
+  swap.start = sb.swapstart;
+  swap.nslot = sb.nswap;
+  if(swap.nslot > NSWAPPAGES)
+    swap.nslot = NSWAPPAGES;
+  cprintf("swap: %d pages at block %d\n", swap.nslot, swap.start);
+}
+
+// Read or write one page at slot, a block at a time.
+// The buf lives on the stack: allocating it could need the
+// memory that swapping is trying to free.
+static void
+swaprw(uint slot, char *mem, int write)
+{
+  struct buf b;
+  int i;
+
+  for(i = 0; i < SWAPBPP; i++){
+    b.dev = swap.dev;
+    b.blockno = swap.start + slot*SWAPBPP + i;
+    b.flags = B_BUSY;
+    b.done = 0;
+    if(write){
+      memmove(b.data, mem + i*BSIZE, BSIZE);
+      b.flags |= B_DIRTY;
+    }
+    iderw(&b);
+    if(!write)
+      memmove(mem + i*BSIZE, b.data, BSIZE);
+  }
+}
+
+// Find a free slot and mark it BUSY.  Returns -1 if none.
+static int
+slotalloc(void)
+{
+  uint i;
+
+  acquire(&swap.lock);
+  for(i = 0; i < swap.nslot; i++){
+    if(swap.state[i] == SLOT_FREE){
+      swap.state[i] = SLOT_BUSY;
+      swap.nused++;
+      release(&swap.lock);
+      return i;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+// Release the slot named by a PTE_SWAPPED entry whose
+// page is no longer wanted.
+void
+swapfree(pte_t pte)
+{
+  uint slot;
+
+  slot = PTE_ADDR(pte) >> PTXSHIFT;
+  acquire(&swap.lock);
+  if(swap.state[slot] == SLOT_BUSY)
+    swap.state[slot] = SLOT_ORPHANED;
+  else {
+    swap.state[slot] = SLOT_FREE;
+    swap.nused--;
+  }
+  release(&swap.lock);
+}
+
+// Evict one user page to swap.  Returns 0 on success,
+// -1 if there is no swap space or no page to evict.
+int
+swapout(void)
+{
+  char *mem;
+  int slot;
+
+  if(swap.nslot == 0 || (slot = slotalloc()) < 0)
+    return -1;
+  if((mem = clockvictim(slot)) == 0){
+    acquire(&swap.lock);
+    swap.state[slot] = SLOT_FREE;
+    swap.nused--;
+    release(&swap.lock);
+    return -1;
+  }
+  swaprw(slot, mem, 1);
+  kfree(mem);
+
+  acquire(&swap.lock);
+  swap.nout++;
+  if(swap.state[slot] == SLOT_ORPHANED){
+    swap.state[slot] = SLOT_FREE;
+    swap.nused--;
+  } else
+    swap.state[slot] = SLOT_USED;
+  wakeup(&swap.state[slot]);
+  release(&swap.lock);
+  return 0;
+}
+
+// Allocate a zeroed page for user memory.  If memory is full,
+// shrink the buffer cache, or failing that push other
+// processes' pages out to swap.
+// Must not be called with any spinlock held.
+// Returns 0 if the memory cannot be allocated.
+char*
+ualloc(void)
+{
+  char *mem;
+
+  while((mem = kzalloc()) == 0)
+    if(bshrink() == 0 && swapout() < 0)
+      return 0;
+  return mem;
+}
+
+// Read the page described by PTE_SWAPPED entry pte into mem,
+// waiting for it to finish going out first if need be.
+// The slot stays allocated.
+void
+swapread(pte_t pte, char *mem)
+{
+  uint slot;
+
+  slot = PTE_ADDR(pte) >> PTXSHIFT;
+  acquire(&swap.lock);
+  while(swap.state[slot] == SLOT_BUSY)
+    sleep(&swap.state[slot], &swap.lock);
+  release(&swap.lock);
+  swaprw(slot, mem, 0);
+}
+
+// Bring the page at va back in if it was swapped out.
+// Returns 0 if the page is now present, -1 if va was
+// not swapped out or memory ran out.
+// Caller must hold lockvm().
+int
+swapfault(uint va)
+{
+  pte_t *pte, old;
+  char *mem;
+
+  if(proc == 0 || va >= proc->sz)
+    return -1;
+  if((proc->pgdir[PDX(va)] & PTE_PS) ||
+     (pte = walkpgdir(proc->pgdir, (char*)va, 0)) == 0)
+    return -1;
+  if(*pte & PTE_P)
+    return 0;   // another thread got here first
+  if((*pte & PTE_SWAPPED) == 0)
+    return -1;
+  old = *pte;
+  if((mem = ualloc()) == 0)
+    return -1;
+  swapread(old, mem);
+  *pte = v2p(mem) | PTE_FLAGS(old & ~PTE_SWAPPED) | PTE_P;
+  swapfree(old);
+
+  proc->majflt++;
+  acquire(&swap.lock);
+  swap.majflt++;
+  release(&swap.lock);
+  return 0;
+}
+
+// Count a fault that was served without swap I/O.
+void
+minorfault(void)
+{
+  proc->minflt++;
+  acquire(&swap.lock);
+  swap.minflt++;
+  release(&swap.lock);
+}
+
+// Make sure [va, va+n) of the current process's memory is
+// resident, so the kernel can use it directly, and pin it
+// there until the system call returns.
+int
+swapprefault(uint va, uint n)
+{
+  uint a;
+  pte_t *pte;
+
+  pinuser(va, n);
+  lockvm();
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE){
+    if(proc->pgdir[PDX(a)] & PTE_PS)
+      continue;
+    pte = walkpgdir(proc->pgdir, (char*)a, 0);
+    if(pte && (*pte & PTE_SWAPPED) && swapfault(a) < 0){
+      unlockvm();
+      return -1;
+    }
+  }
+  unlockvm();
+  return 0;
+}
+
+// Print swap usage and fault counts to the console.
+void
+swapdump(void)
+{
+  cprintf("swap: %d/%d pages used, %d swapped out, faults %d major %d minor\n",
+          swap.nused, swap.nslot, swap.nout, swap.majflt, swap.minflt);
+}
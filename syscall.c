@@ -3,6 +3,7 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "x86.h"
 #include "syscall.h"
@@ -17,7 +18,10 @@
 int
 fetchint(uint addr, int *ip)
 {
-  if(addr >= proc->sz || addr+4 > proc->sz)
+  if(addr >= proc->sz || addr+4 > proc->sz){
+    if(vmaprefault(addr, 4, 0) < 0)
+      return -1;
+  } else if(swapprefault(addr, 4) < 0)
     return -1;
   *ip = *(int*)(addr);
   return 0;
@@ -32,12 +36,15 @@ fetchstr(uint addr, char **pp)
   char *s, *ep;
 
   if(addr >= proc->sz)
-    return -1;
+    return vmafetchstr(addr, pp);
   *pp = (char*)addr;
   ep = (char*)proc->sz;
-  for(s = *pp; s < ep; s++)
+  for(s = *pp; s < ep; s++){
+    if((s == *pp || (uint)s % PGSIZE == 0) && swapprefault((uint)s, 1) < 0)
+      return -1;
     if(*s == 0)
       return s - *pp;
+  }
   return -1;
 }
 
@@ -50,15 +57,23 @@ argint(int n, int *ip)
 
 // Fetch the nth word-sized system call argument as a pointer
 // to a block of memory of size n bytes.  Check that the pointer
-// lies within the process address space.
+// lies within the process address space: the heap, or one
+// mmap() region, which must be writable if the kernel is going
+// to write to the block (write != 0).  Its pages are faulted
+// in here.
 int
-argptr(int n, char **pp, int size)
+argptr(int n, char **pp, int size, int write)
 {
   int i;
 
   if(argint(n, &i) < 0)
     return -1;
-  if((uint)i >= proc->sz || (uint)i+size > proc->sz)
+  if(size < 0)
+    return -1;
+  if((uint)i >= proc->sz || (uint)i+size > proc->sz){
+    if(vmaprefault(i, size, write) < 0)
+      return -1;
+  } else if(swapprefault(i, size) < 0)
     return -1;
   *pp = (char*)i;
   return 0;
@@ -98,6 +113,17 @@ extern int sys_unlink(void);
 extern int sys_wait(void);
 extern int sys_write(void);
 extern int sys_uptime(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_shmget(void);
+extern int sys_shmat(void);
+extern int sys_shmdt(void);
+extern int sys_getfaults(void);
+extern int sys_clone(void);
+extern int sys_join(void);
+extern int sys_futex_wait(void);
+extern int sys_futex_wake(void);
+extern int sys_spawn(void);
 extern int sys_history(void);
 extern int sys_wait2(void);
 extern int sys_set_prio(void);
@@ -128,7 +154,18 @@ static int (*syscalls[])(void) = {
 [SYS_history]   sys_history,
 [SYS_wait2]   sys_wait2,
 [SYS_set_prio] sys_set_prio,
-[SYS_yield]   sys_yield
+[SYS_yield]   sys_yield,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_shmget]  sys_shmget,
+[SYS_shmat]   sys_shmat,
+[SYS_shmdt]   sys_shmdt,
+[SYS_getfaults] sys_getfaults,
+[SYS_clone]   sys_clone,
+[SYS_join]    sys_join,
+[SYS_futex_wait] sys_futex_wait,
+[SYS_futex_wake] sys_futex_wake,
+[SYS_spawn]   sys_spawn,
 };
 
 
@@ -24,3 +24,14 @@
 #define SYS_wait2  23
 #define SYS_set_prio 24
 #define SYS_yield  25
+#define SYS_mmap   26
+#define SYS_munmap 27
+#define SYS_shmget 28
+#define SYS_shmat  29
+#define SYS_shmdt  30
+#define SYS_getfaults 31
+#define SYS_clone  32
+#define SYS_join   33
+#define SYS_futex_wait 34
+#define SYS_futex_wake 35
+#define SYS_spawn  36
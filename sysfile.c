@@ -9,14 +9,19 @@
 #include "param.h"
 #include "stat.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "fs.h"
 #include "file.h"
 #include "fcntl.h"
+#include "mman.h"
+#include "spawn.h"
 #include "console.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
+// The file comes with a new reference, so a sibling thread closing
+// fd cannot free it; the caller must fileclose() it when done.
 static int
 argfd(int n, int *pfd, struct file **pf)
 {
@@ -25,12 +30,18 @@ argfd(int n, int *pfd, struct file **pf)
 
   if(argint(n, &fd) < 0)
     return -1;
-  if(fd < 0 || fd >= NOFILE || (f=proc->ofile[fd]) == 0)
+  if(fd < 0 || fd >= NOFILE)
     return -1;
+  acquire(&proc->leader->fdlock);
+  if((f=proc->leader->ofile[fd]) == 0){
+    release(&proc->leader->fdlock);
+    return -1;
+  }
+  filedup(f);
+  release(&proc->leader->fdlock);
   if(pfd)
     *pfd = fd;
-  if(pf)
-    *pf = f;
+  *pf = f;
   return 0;
 }
 
@@ -41,15 +52,34 @@ fdalloc(struct file *f)
 {
   int fd;
 
+  acquire(&proc->leader->fdlock);
   for(fd = 0; fd < NOFILE; fd++){
-    if(proc->ofile[fd] == 0){
-      proc->ofile[fd] = f;
+    if(proc->leader->ofile[fd] == 0){
+      proc->leader->ofile[fd] = f;
+      release(&proc->leader->fdlock);
       return fd;
     }
   }
+  release(&proc->leader->fdlock);
   return -1;
 }
 
+// Remove fd from the file table and return its file,
+// whose reference passes to the caller, or 0.
+static struct file*
+fdclear(int fd)
+{
+  struct file *f;
+
+  if(fd < 0 || fd >= NOFILE)
+    return 0;
+  acquire(&proc->leader->fdlock);
+  f = proc->leader->ofile[fd];
+  proc->leader->ofile[fd] = 0;
+  release(&proc->leader->fdlock);
+  return f;
+}
+
 int
 sys_dup(void)
 {
@@ -58,9 +88,10 @@ sys_dup(void)
   
   if(argfd(0, 0, &f) < 0)
     return -1;
-  if((fd=fdalloc(f)) < 0)
+  if((fd=fdalloc(f)) < 0){
+    fileclose(f);
     return -1;
-  filedup(f);
+  }
   return fd;
 }
 
@@ -68,24 +99,28 @@ int
 sys_read(void)
 {
   struct file *f;
-  int n;
+  int n, r;
   char *p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+  if(argint(2, &n) < 0 || argptr(1, &p, n, 1) < 0 || argfd(0, 0, &f) < 0)
     return -1;
-  return fileread(f, p, n);
+  r = fileread(f, p, n);
+  fileclose(f);
+  return r;
 }
 
 int
 sys_write(void)
 {
   struct file *f;
-  int n;
+  int n, r;
   char *p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+  if(argint(2, &n) < 0 || argptr(1, &p, n, 0) < 0 || argfd(0, 0, &f) < 0)
     return -1;
-  return filewrite(f, p, n);
+  r = filewrite(f, p, n);
+  fileclose(f);
+  return r;
 }
 
 int
@@ -94,9 +129,9 @@ sys_close(void)
   int fd;
   struct file *f;
   
-  if(argfd(0, &fd, &f) < 0)
+  // Two threads may close fd at once; only one gets the file.
+  if(argint(0, &fd) < 0 || (f = fdclear(fd)) == 0)
     return -1;
-  proc->ofile[fd] = 0;
   fileclose(f);
   return 0;
 }
@@ -106,10 +141,13 @@ sys_fstat(void)
 {
   struct file *f;
   struct stat *st;
+  int r;
   
-  if(argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0)
+  if(argptr(1, (void*)&st, sizeof(*st), 1) < 0 || argfd(0, 0, &f) < 0)
     return -1;
-  return filestat(f, st);
+  r = filestat(f, st);
+  fileclose(f);
+  return r;
 }
 
 // Create the path new as a link to the same inode as old.
@@ -256,8 +294,10 @@ create(char *path, short type, short major, short minor)
     return 0;
   }
 
-  if((ip = ialloc(dp->dev, type)) == 0)
-    panic("create: ialloc");
+  if((ip = ialloc(dp->dev, type)) == 0){
+    iunlockput(dp);
+    return 0;
+  }
 
   ilock(ip);
   ip->major = major;
@@ -273,8 +313,18 @@ create(char *path, short type, short major, short minor)
       panic("create dots");
   }
 
-  if(dirlink(dp, name, ip->inum) < 0)
-    panic("create: dirlink");
+  if(dirlink(dp, name, ip->inum) < 0){
+    // name appeared while dirlookup() could not tell (no memory).
+    if(type == T_DIR){
+      dp->nlink--;
+      iupdate(dp);
+    }
+    ip->nlink = 0;
+    iupdate(ip);
+    iunlockput(ip);
+    iunlockput(dp);
+    return 0;
+  }
 
   iunlockput(dp);
 
@@ -386,25 +436,22 @@ sys_chdir(void)
     return -1;
   }
   iunlock(ip);
-  iput(proc->cwd);
+  iput(proc->leader->cwd);
   end_op();
-  proc->cwd = ip;
+  proc->leader->cwd = ip;
   return 0;
 }
 
-int
-sys_exec(void)
+// Fetch the null-terminated user array of strings at uargv.
+static int
+fetchargv(uint uargv, char **argv)
 {
-  char *path, *argv[MAXARG];
   int i;
-  uint uargv, uarg;
+  uint uarg;
 
-  if(argstr(0, &path) < 0 || argint(1, (int*)&uargv) < 0){
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, MAXARG*sizeof(argv[0]));
   for(i=0;; i++){
-    if(i >= NELEM(argv))
+    if(i >= MAXARG)
       return -1;
     if(fetchint(uargv+4*i, (int*)&uarg) < 0)
       return -1;
@@ -415,9 +462,43 @@ sys_exec(void)
     if(fetchstr(uarg, &argv[i]) < 0)
       return -1;
   }
+  return 0;
+}
+
+int
+sys_exec(void)
+{
+  char *path, *argv[MAXARG];
+  uint uargv;
+
+  if(argstr(0, &path) < 0 || argint(1, (int*)&uargv) < 0){
+    return -1;
+  }
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
   return exec(path, argv);
 }
 
+int
+sys_spawn(void)
+{
+  char *path, *argv[MAXARG];
+  uint uargv;
+  int nacts;
+  struct spawnact *acts;
+
+  if(argstr(0, &path) < 0 || argint(1, (int*)&uargv) < 0 ||
+     argint(3, &nacts) < 0)
+    return -1;
+  if(nacts < 0 || nacts > SPAWNMAXACT)
+    return -1;
+  if(argptr(2, (char**)&acts, nacts*sizeof(*acts), 0) < 0)
+    return -1;
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
+  return spawn(path, argv, acts, nacts);
+}
+
 int
 sys_pipe(void)
 {
@@ -425,14 +506,14 @@ sys_pipe(void)
   struct file *rf, *wf;
   int fd0, fd1;
 
-  if(argptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
+  if(argptr(0, (void*)&fd, 2*sizeof(fd[0]), 1) < 0)
     return -1;
   if(pipealloc(&rf, &wf) < 0)
     return -1;
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
     if(fd0 >= 0)
-      proc->ofile[fd0] = 0;
+      fdclear(fd0);
     fileclose(rf);
     fileclose(wf);
     return -1;
@@ -458,3 +539,32 @@ sys_pipe(void)
 
 
 
+
+int
+sys_mmap(void)
+{
+  int addr, len, prot, flags, off, r;
+  struct file *f;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argint(5, &off) < 0)
+    return -1;
+  f = 0;
+  if(!(flags & MAP_ANONYMOUS) && argfd(4, 0, &f) < 0)
+    return -1;
+  // addr is only a hint, and is ignored.
+  r = mmap(len, prot, flags, f, off);
+  if(f)
+    fileclose(f);
+  return r;
+}
+
+int
+sys_munmap(void)
+{
+  int addr, len;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0)
+    return -1;
+  return munmap(addr, len);
+}
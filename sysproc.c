@@ -5,6 +5,7 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 
 int
@@ -13,6 +14,50 @@ sys_fork(void)
   return fork();
 }
 
+int
+sys_clone(void)
+{
+  int fn, arg;
+  char *stack;
+
+  if(argint(0, &fn) < 0 || argint(1, &arg) < 0 ||
+     argptr(2, &stack, PGSIZE, 1) < 0)
+    return -1;
+  return clone((void(*)(void*))fn, (void*)arg, stack);
+}
+
+int
+sys_join(void)
+{
+  void **stack;
+
+  if(argptr(0, (void*)&stack, sizeof(*stack), 1) < 0)
+    return -1;
+  return join(stack);
+}
+
+int
+sys_futex_wait(void)
+{
+  char *addr;
+  int val;
+
+  if(argptr(0, &addr, sizeof(uint), 0) < 0 || argint(1, &val) < 0)
+    return -1;
+  return futexwait((uint)addr, val);
+}
+
+int
+sys_futex_wake(void)
+{
+  char *addr;
+  int n;
+
+  if(argptr(0, &addr, sizeof(uint), 0) < 0 || argint(1, &n) < 0)
+    return -1;
+  return futexwake((uint)addr, n);
+}
+
 int
 sys_exit(void)
 {
@@ -33,11 +78,11 @@ sys_wait(void)
 */
 int sys_wait2(void) {
   int *retime, *rutime, *stime;
-  if (argptr(0, (void*)&retime, sizeof(retime)) < 0)
+  if (argptr(0, (void*)&retime, sizeof(retime), 1) < 0)
     return -1;
-  if (argptr(1, (void*)&rutime, sizeof(retime)) < 0)
+  if (argptr(1, (void*)&rutime, sizeof(retime), 1) < 0)
     return -1;
-  if (argptr(2, (void*)&stime, sizeof(stime)) < 0)
+  if (argptr(2, (void*)&stime, sizeof(stime), 1) < 0)
     return -1;
   return wait2(retime, rutime, stime);
 }
@@ -72,6 +117,51 @@ sys_sbrk(void)
   return addr;
 }
 
+int
+sys_shmget(void)
+{
+  char *name;
+  int size;
+
+  if(argstr(0, &name) < 0 || argint(1, &size) < 0)
+    return -1;
+  return shmget(name, size);
+}
+
+int
+sys_shmat(void)
+{
+  int id;
+
+  if(argint(0, &id) < 0)
+    return -1;
+  return shmat(id);
+}
+
+int
+sys_shmdt(void)
+{
+  int addr;
+
+  if(argint(0, &addr) < 0)
+    return -1;
+  return shmdt(addr);
+}
+
+// Report the current process's major and minor page faults.
+int
+sys_getfaults(void)
+{
+  int *majflt, *minflt;
+
+  if(argptr(0, (void*)&majflt, sizeof(*majflt), 1) < 0 ||
+     argptr(1, (void*)&minflt, sizeof(*minflt), 1) < 0)
+    return -1;
+  *majflt = proc->majflt;
+  *minflt = proc->minflt;
+  return 0;
+}
+
 int
 sys_sleep(void)
 {
@@ -114,7 +204,7 @@ sys_uptime(void)
 int sys_history(void) {
   char *buffer;
   int historyId;
-  argptr(0, &buffer, 1);
+  argptr(0, &buffer, 1, 1);
   argint(1, &historyId);
   return history(buffer, historyId);
 }
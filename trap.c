@@ -3,10 +3,10 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "x86.h"
 #include "traps.h"
-#include "spinlock.h"
 
 // Interrupt descriptor table (shared by all CPUs).
 struct gatedesc idt[256];
@@ -43,11 +43,17 @@ trap(struct trapframe *tf)
       exit();
     proc->tf = tf;
     syscall();
+    unpinuser();
     if(proc->killed)
       exit();
     return;
   }
 
+  // First FPU use since the process was scheduled; see fpu.c.
+  if(tf->trapno == T_DEVICE && proc && (tf->cs&3) == DPL_USER &&
+     fputrap() == 0)
+    return;
+
   switch(tf->trapno){
   case T_IRQ0 + IRQ_TIMER:
     if(cpu->id == 0){
@@ -86,6 +92,11 @@ trap(struct trapframe *tf)
     uartintr();
     lapiceoi();
     break;
+  case T_TLBFLUSH:
+    lcr3(rcr3());
+    cpu->tlbflush = 0;
+    lapiceoi();
+    break;
   case T_IRQ0 + 7:
   case T_IRQ0 + IRQ_SPURIOUS:
     cprintf("cpu%d: spurious interrupt at %x:%x\n",
@@ -93,8 +104,24 @@ trap(struct trapframe *tf)
     lapiceoi();
     break;
 
+  case T_PGFLT:
+    if(proc && !(tf->err & FEC_PR)){
+      int r;
+      lockvm();
+      r = vmafault(rcr2()) == 0 || swapfault(rcr2()) == 0;
+      unlockvm();
+      if(r)
+        break;
+    }
+    // Not an mmap() or swapped page; treat like any other fault.
+
   //PAGEBREAK: 13
   default:
+    // PCI devices get their IRQ at boot.
+    if(virtiointr(tf->trapno)){
+      lapiceoi();
+      break;
+    }
     if(proc == 0 || (tf->cs&3) == 0){
       // In kernel, it must be our mistake.
       cprintf("unexpected trap %d from cpu %d eip %x (cr2=0x%x)\n",
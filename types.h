@@ -1,7 +1,9 @@
 typedef unsigned int   uint;
 typedef unsigned short ushort;
 typedef unsigned char  uchar;
+typedef unsigned long long uint64;
 typedef uint pde_t;
+typedef uint pte_t;
 
 #define INPUT_BUF 128
 #define MAX_HISTORY 16
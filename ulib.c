@@ -4,6 +4,71 @@
 #include "user.h"
 #include "x86.h"
 
+// memmove, memset, strlen and strcmp each have a simple loop
+// version and an SSE2 version that works 16 bytes at a time;
+// the first call picks one using cpuid.  Only the SSE2
+// versions are compiled for SSE2, so the loops still run on
+// older CPUs.  strlen and strcmp must not read past the page
+// holding the end of the string, so they only use 16-byte
+// loads that cannot cross a page boundary.
+
+#define SSE2        __attribute__((target("sse2")))
+#define CPUID_SSE2  (1<<26)
+#define PAGE        4096
+
+static int sse2 = -1;  // unknown until first use
+
+static int
+havesse2(void)
+{
+  uint eax, ebx, ecx, edx;
+
+  if(sse2 < 0){
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    sse2 = (edx & CPUID_SSE2) != 0;
+  }
+  return sse2;
+}
+
+// Bit i set if byte i of the 16-byte aligned block at p is 0.
+static inline SSE2 uint
+zeromask16(const void *p)
+{
+  uint m;
+
+  asm volatile("pxor %%xmm0, %%xmm0\n\t"
+               "pcmpeqb (%1), %%xmm0\n\t"
+               "pmovmskb %%xmm0, %0"
+               : "=r" (m) : "r" (p) : "xmm0", "memory");
+  return m;
+}
+
+// Bit i set if p[i] == q[i] and p[i] != 0.
+static inline SSE2 uint
+samemask16(const void *p, const void *q)
+{
+  uint m;
+
+  asm volatile("movdqu (%1), %%xmm0\n\t"
+               "movdqu (%2), %%xmm1\n\t"
+               "pcmpeqb %%xmm0, %%xmm1\n\t"
+               "pxor %%xmm2, %%xmm2\n\t"
+               "pcmpeqb %%xmm0, %%xmm2\n\t"
+               "pandn %%xmm1, %%xmm2\n\t"
+               "pmovmskb %%xmm2, %0"
+               : "=r" (m) : "r" (p), "r" (q) : "xmm0", "xmm1", "xmm2", "memory");
+  return m;
+}
+
+// Copy 16 bytes; the load completes before the store.
+static inline SSE2 void
+copy16(void *dst, const void *src)
+{
+  asm volatile("movdqu (%1), %%xmm0\n\t"
+               "movdqu %%xmm0, (%0)"
+               : : "r" (dst), "r" (src) : "xmm0", "memory");
+}
+
 char*
 strcpy(char *s, char *t)
 {
@@ -15,16 +80,44 @@ strcpy(char *s, char *t)
   return os;
 }
 
-int
-strcmp(const char *p, const char *q)
+static int
+strcmp_byte(const char *p, const char *q)
 {
   while(*p && *p == *q)
     p++, q++;
   return (uchar)*p - (uchar)*q;
 }
 
-uint
-strlen(char *s)
+static SSE2 int
+strcmp_sse2(const char *p, const char *q)
+{
+  uint m, i;
+
+  for(;;){
+    if((uint)p % PAGE > PAGE-16 || (uint)q % PAGE > PAGE-16){
+      // Near a page end: one byte at a time.
+      if(*p == 0 || *p != *q)
+        return (uchar)*p - (uchar)*q;
+      p++, q++;
+      continue;
+    }
+    if((m = samemask16(p, q)) != 0xffff){
+      i = __builtin_ctz(~m);
+      return (uchar)p[i] - (uchar)q[i];
+    }
+    p += 16;
+    q += 16;
+  }
+}
+
+int
+strcmp(const char *p, const char *q)
+{
+  return havesse2() ? strcmp_sse2(p, q) : strcmp_byte(p, q);
+}
+
+static uint
+strlen_byte(char *s)
 {
   int n;
 
@@ -33,10 +126,62 @@ strlen(char *s)
   return n;
 }
 
+static SSE2 uint
+strlen_sse2(char *s)
+{
+  uint m;
+  char *p;
+
+  // Aligned blocks never cross a page; ignore the bytes before s.
+  p = (char*)((uint)s & ~15);
+  m = zeromask16(p) >> (s - p);
+  if(m)
+    return __builtin_ctz(m);
+  for(;;){
+    p += 16;
+    if((m = zeromask16(p)) != 0)
+      return p - s + __builtin_ctz(m);
+  }
+}
+
+uint
+strlen(char *s)
+{
+  return havesse2() ? strlen_sse2(s) : strlen_byte(s);
+}
+
+// Bytes up to a 16-byte boundary, aligned 16-byte stores,
+// then the tail.  The broadcast and the stores are one asm
+// statement so the compiler cannot reuse xmm0 in between.
+// Callers pass n >= 64, so there is at least one store.
+static SSE2 void
+memset_sse2(char *d, int c, uint n)
+{
+  uint v, k;
+
+  k = -(uint)d & 15;
+  stosb(d, c, k);
+  d += k;
+  n -= k;
+  v = (c & 0xff) * 0x01010101;
+  asm volatile("movd %2, %%xmm0\n\t"
+               "pshufd $0, %%xmm0, %%xmm0\n"
+               "1:\tmovdqa %%xmm0, (%0)\n\t"
+               "addl $16, %0\n\t"
+               "subl $16, %1\n\t"
+               "cmpl $16, %1\n\t"
+               "jae 1b"
+               : "+r" (d), "+r" (n) : "r" (v) : "xmm0", "memory", "cc");
+  stosb(d, c, n);
+}
+
 void*
 memset(void *dst, int c, uint n)
 {
-  stosb(dst, c, n);
+  if(n >= 64 && havesse2())
+    memset_sse2(dst, c, n);
+  else
+    stosb(dst, c, n);
   return dst;
 }
 
@@ -95,14 +240,43 @@ atoi(const char *s)
   return n;
 }
 
+static void
+memmove_byte(char *dst, char *src, int n)
+{
+  if(src < dst && src + n > dst){
+    while(n-- > 0)
+      dst[n] = src[n];
+  } else {
+    while(n-- > 0)
+      *dst++ = *src++;
+  }
+}
+
+static SSE2 void
+memmove_sse2(char *dst, char *src, int n)
+{
+  if(dst <= src || dst >= src + n){
+    for(; n >= 16; n -= 16, dst += 16, src += 16)
+      copy16(dst, src);
+    while(n-- > 0)
+      *dst++ = *src++;
+  } else {
+    // dst overlaps the end of src: copy from the end.
+    while(n >= 16){
+      n -= 16;
+      copy16(dst + n, src + n);
+    }
+    while(n-- > 0)
+      dst[n] = src[n];
+  }
+}
+
 void*
 memmove(void *vdst, void *vsrc, int n)
 {
-  char *dst, *src;
-
-  dst = vdst;
-  src = vsrc;
-  while(n-- > 0)
-    *dst++ = *src++;
+  if(n >= 16 && havesse2())
+    memmove_sse2(vdst, vsrc, n);
+  else
+    memmove_byte(vdst, vsrc, n);
   return vdst;
 }
@@ -2,89 +2,266 @@
 #include "stat.h"
 #include "user.h"
 #include "param.h"
+#include "x86.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Size-class memory allocator.
+//
+// Small requests (up to SMALLMAX bytes including the header)
+// are rounded up to one of NCLASS power-of-two block sizes.
+// Each class keeps a free list of blocks, carved a page at a
+// time, so malloc and free of small blocks are a list pop and
+// push.  Larger requests get a run of whole pages.  Free page
+// runs are kept sorted and merged, and a free run that ends at
+// the program break is given back to the kernel with sbrk(-n).
+//
+// Threads made by thread_create() share the heap.  Each thread
+// uses one of NTCACHE caches of small blocks, picked by its
+// stack page, and takes the global lock only to move a batch
+// of blocks between its cache and the class lists.
 
-typedef long Align;
+#define PAGE      4096
+#define MINSHIFT  4                      // smallest class: 16 bytes
+#define NCLASS    8                      // 16 .. 2048 bytes
+#define SMALLMAX  (1 << (MINSHIFT+NCLASS-1))
+#define NTCACHE   8
+#define BATCH     8                      // blocks moved per refill
+#define TCMAX     32                     // blocks a cache may hold per class
 
-union header {
+// Every block starts with a header; malloc returns the byte after it.
+typedef union header {
   struct {
-    union header *ptr;
-    uint size;
+    uint size;   // class index if < NCLASS, else bytes in page run
+    uint pad;
   } s;
-  Align x;
+  long long x;   // keep blocks 8-byte aligned
+} Header;
+
+// A free block or page run, linked through its first bytes.
+struct run {
+  struct run *next;
+  uint size;     // page runs only: bytes in the run
 };
 
-typedef union header Header;
+struct lock {
+  volatile uint locked;
+};
 
-static Header base;
-static Header *freep;
+static struct {
+  struct lock lock;
+  struct run *free[NCLASS];  // free blocks of each class
+  struct run *pages;         // free page runs, sorted by address
+} heap;
 
-void
-free(void *ap)
+static struct {
+  struct lock lock;
+  struct run *free[NCLASS];
+  uint n[NCLASS];
+} tcache[NTCACHE];
+
+static void
+acquire(struct lock *l)
 {
-  Header *bp, *p;
-
-  bp = (Header*)ap - 1;
-  for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-    if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
-      break;
-  if(bp + bp->s.size == p->s.ptr){
-    bp->s.size += p->s.ptr->s.size;
-    bp->s.ptr = p->s.ptr->s.ptr;
-  } else
-    bp->s.ptr = p->s.ptr;
-  if(p + p->s.size == bp){
-    p->s.size += bp->s.size;
-    p->s.ptr = bp->s.ptr;
-  } else
-    p->s.ptr = bp;
-  freep = p;
+  while(xchg(&l->locked, 1) != 0)
+    yield();
 }
 
-static Header*
-morecore(uint nu)
+static void
+release(struct lock *l)
 {
-  char *p;
-  Header *hp;
+  xchg(&l->locked, 0);
+}
+
+static int
+sizeclass(uint nbytes)
+{
+  int c;
+
+  for(c = 0; (1 << (MINSHIFT+c)) < nbytes; c++)
+    ;
+  return c;
+}
+
+// Index of the calling thread's cache.
+static int
+mycache(void)
+{
+  uint sp;
+
+  sp = (uint)&sp;
+  return (sp / PAGE) % NTCACHE;
+}
+
+// Return the page run at p to the free runs, merging it with
+// its neighbours, and give the top run back to the kernel if
+// it ends at the program break.  Caller holds heap.lock.
+static void
+putpages(struct run *p, uint size)
+{
+  struct run *prev, *r;
+
+  prev = 0;
+  for(r = heap.pages; r && r < p; r = r->next)
+    prev = r;
+  p->size = size;
+  p->next = r;
+  if(r && (char*)p + p->size == (char*)r){
+    p->size += r->size;
+    p->next = r->next;
+  }
+  if(prev && (char*)prev + prev->size == (char*)p){
+    prev->size += p->size;
+    prev->next = p->next;
+    p = prev;
+  } else if(prev)
+    prev->next = p;
+  else
+    heap.pages = p;
+
+  if(p->next == 0 && (char*)p + p->size == sbrk(0)){
+    if(heap.pages == p)
+      heap.pages = 0;
+    else {
+      for(r = heap.pages; r->next != p; r = r->next)
+        ;
+      r->next = 0;
+    }
+    sbrk(-p->size);
+  }
+}
+
+// Get size bytes of page-aligned memory, from the free runs
+// or by growing the heap.  Caller holds heap.lock.
+static char*
+getpages(uint size)
+{
+  struct run **pp, *p;
+  char *brk;
+  uint pad;
 
-  if(nu < 4096)
-    nu = 4096;
-  p = sbrk(nu * sizeof(Header));
-  if(p == (char*)-1)
+  for(pp = &heap.pages; (p = *pp) != 0; pp = &p->next){
+    if(p->size < size)
+      continue;
+    if(p->size == size)
+      *pp = p->next;
+    else {
+      *pp = (struct run*)((char*)p + size);
+      (*pp)->next = p->next;
+      (*pp)->size = p->size - size;
+    }
+    return (char*)p;
+  }
+  brk = sbrk(0);
+  pad = -(uint)brk & (PAGE-1);
+  if(sbrk(pad + size) == (char*)-1)
     return 0;
-  hp = (Header*)p;
-  hp->s.size = nu;
-  free((void*)(hp + 1));
-  return freep;
+  return brk + pad;
+}
+
+// Move up to n blocks of class c onto *list, carving a new
+// page if the class is empty.  Returns the number moved.
+// Caller holds heap.lock.
+static int
+refill(int c, struct run **list, int n)
+{
+  struct run *b;
+  char *p;
+  uint bsize;
+  int i;
+
+  if(heap.free[c] == 0){
+    if((p = getpages(PAGE)) == 0)
+      return 0;
+    bsize = 1 << (MINSHIFT+c);
+    for(i = PAGE - bsize; i >= 0; i -= bsize){
+      b = (struct run*)(p + i);
+      b->next = heap.free[c];
+      heap.free[c] = b;
+    }
+  }
+  for(i = 0; i < n && heap.free[c]; i++){
+    b = heap.free[c];
+    heap.free[c] = b->next;
+    b->next = *list;
+    *list = b;
+  }
+  return i;
+}
+
+void
+free(void *ap)
+{
+  Header *h;
+  struct run *b;
+  int c, t;
+
+  if(ap == 0)
+    return;
+  h = (Header*)ap - 1;
+  if(h->s.size >= NCLASS){
+    acquire(&heap.lock);
+    putpages((struct run*)h, h->s.size);
+    release(&heap.lock);
+    return;
+  }
+
+  c = h->s.size;
+  b = (struct run*)h;
+  t = mycache();
+  acquire(&tcache[t].lock);
+  b->next = tcache[t].free[c];
+  tcache[t].free[c] = b;
+  if(++tcache[t].n[c] > TCMAX){
+    // Give half back to the class list.
+    acquire(&heap.lock);
+    while(tcache[t].n[c] > TCMAX/2){
+      b = tcache[t].free[c];
+      tcache[t].free[c] = b->next;
+      b->next = heap.free[c];
+      heap.free[c] = b;
+      tcache[t].n[c]--;
+    }
+    release(&heap.lock);
+  }
+  release(&tcache[t].lock);
 }
 
 void*
 malloc(uint nbytes)
 {
-  Header *p, *prevp;
-  uint nunits;
+  Header *h;
+  struct run *b;
+  uint size;
+  int c, t;
 
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
-  if((prevp = freep) == 0){
-    base.s.ptr = freep = prevp = &base;
-    base.s.size = 0;
+  if(nbytes > SMALLMAX - sizeof(Header)){
+    size = (nbytes + sizeof(Header) + PAGE-1) & ~(PAGE-1);
+    if(size < nbytes)
+      return 0;
+    acquire(&heap.lock);
+    h = (Header*)getpages(size);
+    release(&heap.lock);
+    if(h == 0)
+      return 0;
+    h->s.size = size;
+    return (void*)(h + 1);
   }
-  for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
-    if(p->s.size >= nunits){
-      if(p->s.size == nunits)
-        prevp->s.ptr = p->s.ptr;
-      else {
-        p->s.size -= nunits;
-        p += p->s.size;
-        p->s.size = nunits;
-      }
-      freep = prevp;
-      return (void*)(p + 1);
-    }
-    if(p == freep)
-      if((p = morecore(nunits)) == 0)
-        return 0;
+
+  c = sizeclass(nbytes + sizeof(Header));
+  t = mycache();
+  acquire(&tcache[t].lock);
+  if(tcache[t].free[c] == 0){
+    acquire(&heap.lock);
+    tcache[t].n[c] += refill(c, &tcache[t].free[c], BATCH);
+    release(&heap.lock);
+  }
+  if((b = tcache[t].free[c]) == 0){
+    release(&tcache[t].lock);
+    return 0;
   }
+  tcache[t].free[c] = b->next;
+  tcache[t].n[c]--;
+  release(&tcache[t].lock);
+  h = (Header*)b;
+  h->s.size = c;
+  return (void*)(h + 1);
 }
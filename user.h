@@ -1,5 +1,6 @@
 struct stat;
 struct rtcdate;
+struct spawnact;
 
 // system calls
 int fork(void);
@@ -29,6 +30,17 @@ int wait2(int*, int*, int*);
 int set_prio(int);
 #endif
 int yield(void);
+void* mmap(void*, uint, int, int, int, uint);
+int munmap(void*, uint);
+int shmget(char*, uint);
+void* shmat(int);
+int shmdt(void*);
+int getfaults(int*, int*);
+int clone(void (*)(void*), void*, void*);
+int join(void**);
+int futex_wait(volatile uint*, uint);
+int futex_wake(volatile uint*, int);
+int spawn(char*, char**, struct spawnact*, int);
 
 // ulib.c
 int stat(char*, struct stat*);
@@ -43,3 +55,21 @@ void* memset(void*, int, uint);
 void* malloc(uint);
 void free(void*);
 int atoi(const char*);
+
+// uthread.c
+struct mutex {
+  volatile uint state;  // 0 free, 1 held, 2 held with waiters
+};
+struct cond {
+  volatile uint seq;    // bumped by every signal
+  volatile uint nwait;  // # threads in cond_wait
+};
+int thread_create(void (*)(void*), void*);
+int thread_join(void);
+void mutex_init(struct mutex*);
+void mutex_lock(struct mutex*);
+void mutex_unlock(struct mutex*);
+void cond_init(struct cond*);
+void cond_wait(struct cond*, struct mutex*);
+void cond_signal(struct cond*);
+void cond_broadcast(struct cond*);
@@ -7,6 +7,8 @@
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
+#include "mman.h"
+#include "spawn.h"
 
 char buf[8192];
 char name[3];
@@ -579,6 +581,68 @@ fourfiles(void)
   printf(1, "fourfiles ok\n");
 }
 
+// four processes update files in one directory while the log
+// commits, so each commit takes some of their system calls and
+// leaves the rest, often for the same blocks, to the next.
+void
+logcommit(void)
+{
+  int fd, pid, i, j, pi, n;
+  char name[3];
+
+  printf(1, "logcommit test\n");
+  name[0] = 'l';
+  name[2] = 0;
+  for(pi = 0; pi < 4; pi++){
+    pid = fork();
+    if(pid < 0){
+      printf(1, "fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      name[1] = '0' + pi;
+      for(i = 0; i < 20; i++){
+        unlink(name);
+        if((fd = open(name, O_CREATE | O_RDWR)) < 0){
+          printf(1, "logcommit create failed\n");
+          exit();
+        }
+        memset(buf, 'a' + i, 3*512);
+        if(write(fd, buf, 3*512) != 3*512){
+          printf(1, "logcommit write failed\n");
+          exit();
+        }
+        close(fd);
+      }
+      exit();
+    }
+  }
+  for(pi = 0; pi < 4; pi++)
+    wait();
+
+  for(pi = 0; pi < 4; pi++){
+    name[1] = '0' + pi;
+    if((fd = open(name, 0)) < 0){
+      printf(1, "logcommit open failed\n");
+      exit();
+    }
+    n = read(fd, buf, sizeof(buf));
+    close(fd);
+    if(n != 3*512){
+      printf(1, "logcommit wrong length %d\n", n);
+      exit();
+    }
+    for(j = 0; j < n; j++){
+      if(buf[j] != 'a' + 19){
+        printf(1, "logcommit wrong data\n");
+        exit();
+      }
+    }
+    unlink(name);
+  }
+  printf(1, "logcommit ok\n");
+}
+
 // four processes create and delete different files in same directory
 void
 createdelete(void)
@@ -1546,6 +1610,603 @@ sbrktest(void)
   printf(stdout, "sbrk test OK\n");
 }
 
+// grow the heap across 4MB boundaries so it gets superpages,
+// then shrink into the middle of one and fork.
+void
+superpagetest(void)
+{
+  char *base, *a;
+  uint amt;
+  int pid;
+
+  printf(stdout, "superpage test\n");
+  base = sbrk(0);
+  amt = 12*1024*1024;
+  if(sbrk(amt) == (char*)0xffffffff){
+    printf(stdout, "superpage sbrk failed\n");
+    exit();
+  }
+  for(a = base; a < base + amt; a += 4096)
+    *a = (uint)a >> 12;
+  for(a = base; a < base + amt; a += 4096){
+    if(*a != (char)((uint)a >> 12)){
+      printf(stdout, "superpage bad value at %x\n", a);
+      exit();
+    }
+  }
+
+  // leave the heap ending 1MB into a superpage
+  a = (char*)(((uint)base + 4*1024*1024) & ~(4*1024*1024 - 1)) + 1024*1024;
+  sbrk(a - sbrk(0));
+  if(sbrk(0) != a){
+    printf(stdout, "superpage shrink failed\n");
+    exit();
+  }
+  a[-1] = 1;
+
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "superpage fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    if(base[0] != (char)((uint)base >> 12) || a[-1] != 1){
+      printf(stdout, "superpage child bad value\n");
+      exit();
+    }
+    exit();
+  }
+  wait();
+
+  sbrk(base - sbrk(0));
+  printf(stdout, "superpage test OK\n");
+}
+
+// a child blocked in a system call is swapped out while the
+// parent fills memory, and gets its data back.
+void
+swaptest(void)
+{
+  char *base, *a, c;
+  int ready[2], go[2], pid, maj0, maj1, min, n;
+
+  printf(stdout, "swap test\n");
+  if(pipe(ready) != 0 || pipe(go) != 0){
+    printf(stdout, "swap pipe failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "swap fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    // a page at a time, so the heap gets no superpages
+    base = sbrk(0);
+    for(n = 0; n < 1024; n++){
+      if((a = sbrk(4096)) == (char*)0xffffffff){
+        printf(stdout, "swap child sbrk failed\n");
+        exit();
+      }
+      *a = n;
+    }
+    getfaults(&maj0, &min);
+    write(ready[1], "r", 1);
+    read(go[0], &c, 1);
+    for(n = 0; n < 1024; n++){
+      if(base[n*4096] != (char)n){
+        printf(stdout, "swap bad value in page %d\n", n);
+        exit();
+      }
+    }
+    getfaults(&maj1, &min);
+    if(maj1 == maj0){
+      printf(stdout, "swap no major faults\n");
+      exit();
+    }
+    exit();
+  }
+
+  // fill memory, which pushes the child's pages out
+  read(ready[0], &c, 1);
+  base = sbrk(0);
+  while(sbrk(4096) != (char*)0xffffffff)
+    ;
+  sbrk(base - sbrk(0));
+  write(go[1], "g", 1);
+  wait();
+  close(ready[0]);
+  close(ready[1]);
+  close(go[0]);
+  close(go[1]);
+  printf(stdout, "swap test OK\n");
+}
+
+// anonymous and file-backed mappings, across fork and syscalls.
+void
+mmaptest(void)
+{
+  char *a, *f;
+  int fd, i, pid, maj, min0, min1;
+
+  printf(stdout, "mmap test\n");
+  getfaults(&maj, &min0);
+
+  a = mmap(0, 3*4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(a == MAP_FAILED){
+    printf(stdout, "mmap anonymous failed\n");
+    exit();
+  }
+  for(i = 0; i < 3*4096; i++){
+    if(a[i] != 0){
+      printf(stdout, "mmap not zero-filled\n");
+      exit();
+    }
+    a[i] = i;
+  }
+  getfaults(&maj, &min1);
+  if(min1 - min0 != 3){
+    printf(stdout, "mmap expected 3 minor faults, got %d\n", min1 - min0);
+    exit();
+  }
+  pid = fork();
+  if(pid == 0){
+    if(a[4097] != (char)4097){
+      printf(stdout, "mmap child bad value\n");
+      exit();
+    }
+    a[0] = 'c';
+    exit();
+  }
+  wait();
+  if(a[0] != 0){
+    printf(stdout, "mmap private page shared with child\n");
+    exit();
+  }
+  if(munmap(a + 4096, 4096) < 0 || a[8192] != (char)8192){
+    printf(stdout, "mmap hole failed\n");
+    exit();
+  }
+  munmap(a, 3*4096);
+
+  // shared anonymous mapping, first touched after fork
+  a = mmap(0, 2*4096, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if(a == MAP_FAILED){
+    printf(stdout, "mmap shared anonymous failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid == 0){
+    a[4096] = 'c';
+    exit();
+  }
+  wait();
+  if(a[4096] != 'c' || a[0] != 0){
+    printf(stdout, "mmap shared anonymous page not shared with child\n");
+    exit();
+  }
+  munmap(a, 2*4096);
+
+  // shared file mapping, written back on munmap
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = 'a';
+  if(write(fd, buf, 6000) != 6000){
+    printf(stdout, "mmap write file failed\n");
+    exit();
+  }
+  f = mmap(0, 6000, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(f == MAP_FAILED){
+    printf(stdout, "mmap file failed\n");
+    exit();
+  }
+  close(fd);
+  if(f[5999] != 'a'){
+    printf(stdout, "mmap file bad contents\n");
+    exit();
+  }
+  f[0] = 'x';
+  f[5000] = 'y';
+  pid = fork();
+  if(pid == 0){
+    f[1] = 'z';
+    exit();
+  }
+  wait();
+  if(f[1] != 'z'){
+    printf(stdout, "mmap shared page not shared with child\n");
+    exit();
+  }
+  f[1] = 'a';
+
+  // a syscall reading straight out of the mapping
+  fd = open("mmapcopy", O_CREATE|O_RDWR);
+  if(write(fd, f, 6000) != 6000){
+    printf(stdout, "mmap write from mapping failed\n");
+    exit();
+  }
+  close(fd);
+  munmap(f, 6000);
+
+  fd = open("mmapfile", 0);
+  if(read(fd, buf, sizeof(buf)) != 6000 || buf[0] != 'x' || buf[5000] != 'y'){
+    printf(stdout, "mmap shared write-back failed\n");
+    exit();
+  }
+
+  // the kernel must not write into a read-only mapping
+  f = mmap(0, 4096, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(f == MAP_FAILED){
+    printf(stdout, "mmap read-only failed\n");
+    exit();
+  }
+  close(fd);
+  fd = open("mmapfile", 0);
+  if(read(fd, f, 4096) >= 0 || f[0] != 'x'){
+    printf(stdout, "mmap read() into read-only mapping succeeded\n");
+    exit();
+  }
+  munmap(f, 4096);
+  close(fd);
+  unlink("mmapfile");
+  unlink("mmapcopy");
+  printf(stdout, "mmap test OK\n");
+}
+
+// a segment attached by two processes shows the same memory.
+void
+shmtest(void)
+{
+  char *a, *b;
+  int id, pid;
+
+  printf(stdout, "shm test\n");
+  if((id = shmget("usertests", 2*4096)) < 0 || (a = shmat(id)) == (char*)-1){
+    printf(stdout, "shmget/shmat failed\n");
+    exit();
+  }
+  a[0] = 1;
+  pid = fork();
+  if(pid == 0){
+    // inherited attachment
+    a[4096] = 2;
+    // and a fresh one to the same segment
+    if((b = shmat(shmget("usertests", 4096))) == (char*)-1 || b == a){
+      printf(stdout, "shm child attach failed\n");
+      exit();
+    }
+    b[1] = b[0] + 2;
+    shmdt(b);
+    exit();
+  }
+  wait();
+  if(a[4096] != 2 || a[1] != 3){
+    printf(stdout, "shm not shared\n");
+    exit();
+  }
+  if(munmap(a, 4096) != -1 || shmdt(a) < 0 || shmdt(a) != -1){
+    printf(stdout, "shmdt failed\n");
+    exit();
+  }
+  // last detach freed it; a new segment starts out zeroed
+  a = shmat(shmget("usertests", 4096));
+  if(a == (char*)-1 || a[0] != 0){
+    printf(stdout, "shm not freed\n");
+    exit();
+  }
+  // the first id named the segment that was freed
+  if(shmat(id) != (char*)-1){
+    printf(stdout, "shm stale id attached\n");
+    exit();
+  }
+  shmdt(a);
+  printf(stdout, "shm test OK\n");
+}
+
+// threads share memory and files, and join() collects them.
+int threadsum[4];
+
+void
+threadworker(void *arg)
+{
+  int i, n = (int)arg;
+
+  for(i = 0; i < 100000; i++)
+    threadsum[n]++;
+  if(n == 3)
+    exit();
+}
+
+void
+clonetest(void)
+{
+  int i, n, tids[4];
+
+  printf(stdout, "clone test\n");
+  for(i = 0; i < 4; i++){
+    if((tids[i] = thread_create(threadworker, (void*)i)) < 0){
+      printf(stdout, "thread_create failed\n");
+      exit();
+    }
+  }
+  for(n = 0; n < 4; n++){
+    if(thread_join() < 0){
+      printf(stdout, "thread_join failed\n");
+      exit();
+    }
+  }
+  if(thread_join() != -1){
+    printf(stdout, "thread_join got too many\n");
+    exit();
+  }
+  for(i = 0; i < 4; i++){
+    if(threadsum[i] != 100000){
+      printf(stdout, "thread %d did not share memory\n", i);
+      exit();
+    }
+  }
+  if(wait() != -1){
+    printf(stdout, "wait saw a thread\n");
+    exit();
+  }
+  printf(stdout, "clone test OK\n");
+}
+
+// a mutex keeps a shared counter exact; a condition variable
+// hands items from a producer to consumer threads.
+struct mutex mtx;
+struct cond cv;
+int counter, items, consumed;
+
+void
+mutexworker(void *arg)
+{
+  int i;
+
+  for(i = 0; i < 20000; i++){
+    mutex_lock(&mtx);
+    counter++;
+    mutex_unlock(&mtx);
+  }
+}
+
+void
+consumer(void *arg)
+{
+  mutex_lock(&mtx);
+  while(consumed < 100){
+    while(items == 0 && consumed < 100)
+      cond_wait(&cv, &mtx);
+    if(items > 0){
+      items--;
+      consumed++;
+    }
+  }
+  cond_broadcast(&cv);
+  mutex_unlock(&mtx);
+}
+
+void
+futextest(void)
+{
+  int i;
+
+  printf(stdout, "futex test\n");
+  mutex_init(&mtx);
+  cond_init(&cv);
+  for(i = 0; i < 4; i++)
+    thread_create(mutexworker, 0);
+  for(i = 0; i < 4; i++)
+    thread_join();
+  if(counter != 4*20000){
+    printf(stdout, "mutex lost updates: %d\n", counter);
+    exit();
+  }
+
+  for(i = 0; i < 2; i++)
+    thread_create(consumer, 0);
+  for(i = 0; i < 100; i++){
+    mutex_lock(&mtx);
+    items++;
+    cond_signal(&cv);
+    mutex_unlock(&mtx);
+  }
+  for(i = 0; i < 2; i++)
+    thread_join();
+  if(consumed != 100 || items != 0){
+    printf(stdout, "cond lost items\n");
+    exit();
+  }
+  if(futex_wait(&mtx.state, 1) != -1){
+    printf(stdout, "futex_wait slept on a changed value\n");
+    exit();
+  }
+  printf(stdout, "futex test OK\n");
+}
+
+// spawn echo with its stdout on a pipe, and check
+// the output and that bad actions are rejected.
+void
+spawntest(void)
+{
+  int fds[2], n, pid;
+  char *args[] = { "echo", "spawned", 0 };
+  struct spawnact acts[3];
+
+  printf(stdout, "spawn test\n");
+  if(pipe(fds) != 0){
+    printf(stdout, "pipe() failed\n");
+    exit();
+  }
+  acts[0].op = SPAWN_DUP2;
+  acts[0].fd = fds[1];
+  acts[0].newfd = 1;
+  acts[1].op = SPAWN_CLOSE;
+  acts[1].fd = fds[0];
+  acts[2].op = SPAWN_CLOSE;
+  acts[2].fd = fds[1];
+  if((pid = spawn("echo", args, acts, 3)) < 0){
+    printf(stdout, "spawn failed\n");
+    exit();
+  }
+  close(fds[1]);
+  n = read(fds[0], buf, sizeof(buf)-1);
+  close(fds[0]);
+  if(wait() != pid){
+    printf(stdout, "spawn wait failed\n");
+    exit();
+  }
+  buf[n > 0 ? n : 0] = 0;
+  if(strcmp(buf, "spawned\n") != 0){
+    printf(stdout, "spawn output wrong\n");
+    exit();
+  }
+
+  acts[0].op = SPAWN_CLOSE;
+  acts[0].fd = NOFILE - 1;
+  if(spawn("echo", args, acts, 1) >= 0){
+    printf(stdout, "spawn accepted a bad fd\n");
+    exit();
+  }
+  if(spawn("nonexistent", args, 0, 0) >= 0){
+    printf(stdout, "spawn of nonexistent file succeeded\n");
+    exit();
+  }
+  printf(stdout, "spawn test OK\n");
+}
+
+// Two processes keep different values in x87 and SSE
+// registers across context switches.
+void
+fputest(void)
+{
+  int pid, i, v, w;
+  double d;
+
+  printf(stdout, "fpu test\n");
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "fork failed\n");
+    exit();
+  }
+  v = pid ? 1234 : 5678;
+  asm volatile("movd %0, %%xmm0" : : "r" (v));
+  d = v;
+  for(i = 0; i < 100; i++){
+    d = d * 3.0 / 3.0;
+    yield();
+  }
+  asm volatile("movd %%xmm0, %0" : "=r" (w));
+  if(w != v || (int)d != v){
+    printf(stdout, "fpu state lost: %d %d %d\n", v, w, (int)d);
+    exit();
+  }
+  if(pid == 0)
+    exit();
+  wait();
+  printf(stdout, "fpu test OK\n");
+}
+
+// ulib string routines on odd alignments and lengths,
+// including strings that end at the top of the heap.
+void
+stringtest(void)
+{
+  char *top, *p;
+  int i, n;
+
+  printf(stdout, "string test\n");
+  for(n = 0; n < 100; n++){
+    for(i = 0; i < 16; i++){
+      memset(buf + i, 'x', n);
+      buf[i+n] = 0;
+      if(strlen(buf + i) != n){
+        printf(stdout, "strlen wrong\n");
+        exit();
+      }
+      memmove(buf + 200 + i, buf + i, n + 1);
+      if(strcmp(buf + i, buf + 200 + i) != 0){
+        printf(stdout, "strcmp wrong\n");
+        exit();
+      }
+      if(n > 0){
+        buf[200+i+n-1] = 'y';
+        if(strcmp(buf + i, buf + 200 + i) >= 0){
+          printf(stdout, "strcmp order wrong\n");
+          exit();
+        }
+      }
+    }
+  }
+
+  // Overlapping moves both ways.
+  for(i = 0; i < 64; i++)
+    buf[i] = i;
+  memmove(buf + 3, buf, 60);
+  memmove(buf, buf + 3, 60);
+  for(i = 0; i < 60; i++)
+    if(buf[i] != i){
+      printf(stdout, "memmove overlap wrong\n");
+      exit();
+    }
+
+  // A string whose NUL is the last byte before unmapped memory.
+  top = sbrk(0);
+  n = 4096 - (uint)top % 4096;
+  sbrk(n);
+  p = top + n - 20;
+  memset(p, 'z', 19);
+  p[19] = 0;
+  memmove(buf, p, 20);
+  if(strlen(p) != 19 || strcmp(p, buf) != 0){
+    printf(stdout, "string at page end wrong\n");
+    exit();
+  }
+  sbrk(-n);
+  printf(stdout, "string test OK\n");
+}
+
+// Small blocks are reused, and freeing a large block at
+// the top of the heap gives the memory back to the kernel.
+void
+malloctest(void)
+{
+  char *a, *b, *top;
+  int i;
+
+  printf(stdout, "malloc test\n");
+  for(i = 1; i < 3000; i += 7){
+    a = malloc(i);
+    memset(a, i, i);
+    b = malloc(i);
+    if(a == b || ((uint)a & 7) != 0){
+      printf(stdout, "malloc overlap or misaligned\n");
+      exit();
+    }
+    free(a);
+    if(malloc(i) != a){
+      printf(stdout, "malloc did not reuse block\n");
+      exit();
+    }
+    free(a);
+    free(b);
+  }
+
+  top = sbrk(0);
+  a = malloc(200*1024);
+  if(sbrk(0) <= top){
+    printf(stdout, "malloc did not grow heap\n");
+    exit();
+  }
+  memset(a, 1, 200*1024);
+  free(a);
+  if(sbrk(0) - top >= 4096){  // allow for page alignment
+    printf(stdout, "free did not shrink heap\n");
+    exit();
+  }
+  printf(stdout, "malloc test OK\n");
+}
+
 void
 validateint(int *p)
 {
@@ -1718,6 +2379,7 @@ main(int argc, char *argv[])
   linkunlink();
   concreate();
   fourfiles();
+  logcommit();
   sharedfd();
 
   bigargtest();
@@ -1725,6 +2387,16 @@ main(int argc, char *argv[])
   bigargtest();
   bsstest();
   sbrktest();
+  superpagetest();
+  swaptest();
+  mmaptest();
+  shmtest();
+  clonetest();
+  futextest();
+  spawntest();
+  fputest();
+  stringtest();
+  malloctest();
   validatetest();
 
   opentest();
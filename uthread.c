@@ -0,0 +1,137 @@
+// User-level threads on top of clone() and join().
+//
+// Threads share the whole address space, open files and
+// current directory.  Each gets a one-page stack from malloc(),
+// which is safe to call from any thread.
+//
+// Mutexes and condition variables use futexes, and only enter
+// the kernel when a thread actually has to wait or be woken.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "param.h"
+#include "x86.h"
+
+#define STACKSIZE 4096  // must match the kernel's PGSIZE
+
+// Kept at the bottom of the thread's stack page.
+struct start {
+  void (*fn)(void*);
+  void *arg;
+};
+
+static void
+threadstart(void *a)
+{
+  struct start *s = a;
+
+  s->fn(s->arg);
+  exit();
+}
+
+// Start fn(arg) in a new thread.  Returns its id, or -1.
+int
+thread_create(void (*fn)(void*), void *arg)
+{
+  struct start *s;
+  int tid;
+
+  if((s = malloc(STACKSIZE)) == 0)
+    return -1;
+  s->fn = fn;
+  s->arg = arg;
+  if((tid = clone(threadstart, s, s)) < 0)
+    free(s);
+  return tid;
+}
+
+// Wait for a thread started by this thread to finish and
+// free its stack.  Returns its id, or -1 if there are none.
+int
+thread_join(void)
+{
+  void *stack;
+  int tid;
+
+  if((tid = join(&stack)) >= 0)
+    free(stack);
+  return tid;
+}
+
+void
+mutex_init(struct mutex *m)
+{
+  m->state = 0;
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+  uint c;
+
+  if((c = cmpxchg(&m->state, 0, 1)) == 0)
+    return;  // uncontended
+  // Mark the mutex contended, and sleep until it is free.
+  if(c != 2)
+    c = xchg(&m->state, 2);
+  while(c != 0){
+    futex_wait(&m->state, 2);
+    c = xchg(&m->state, 2);
+  }
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+  if(xchg(&m->state, 0) == 2)
+    futex_wake(&m->state, 1);
+}
+
+void
+cond_init(struct cond *c)
+{
+  c->seq = 0;
+  c->nwait = 0;
+}
+
+static void
+atomicadd(volatile uint *p, int n)
+{
+  uint v;
+
+  do
+    v = *p;
+  while(cmpxchg(p, v, v + n) != v);
+}
+
+// Release m, wait for a signal, and reacquire m.
+// As with any condition variable, wakeups may be spurious.
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+  uint seq;
+
+  seq = c->seq;
+  atomicadd(&c->nwait, 1);
+  mutex_unlock(m);
+  futex_wait(&c->seq, seq);
+  atomicadd(&c->nwait, -1);
+  mutex_lock(m);
+}
+
+void
+cond_signal(struct cond *c)
+{
+  atomicadd(&c->seq, 1);
+  if(c->nwait)
+    futex_wake(&c->seq, 1);
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+  atomicadd(&c->seq, 1);
+  if(c->nwait)
+    futex_wake(&c->seq, NPROC);
+}
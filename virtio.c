@@ -0,0 +1,281 @@
+// virtio-blk driver, for QEMU's -drive if=virtio.
+//
+// Each request is a chain of three descriptors in one
+// virtqueue: the request header, the buf's data and a status
+// byte.  Requests go on the queue without waiting for earlier
+// ones, so the device can have as many in flight as the
+// queue holds, and one interrupt completes every request the
+// device has finished since the last.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "x86.h"
+#include "traps.h"
+#include "fs.h"
+#include "buf.h"
+#include "pci.h"
+#include "virtio.h"
+
+#define VQMAX 1024  // largest queue we can drive
+
+static struct {
+  struct spinlock lock;
+  ushort base;    // I/O ports
+  int irq;        // 0 if there is no device
+  uint num;       // descriptors in the queue
+  struct vring_desc *desc;
+  struct vring_avail *avail;
+  struct vring_used *used;
+  ushort freehead;  // free descriptors, linked by next
+  uint nfree;
+  ushort lastused;  // used->idx already processed
+  int plugged;      // see ideplug()
+  int kick;         // requests queued while plugged
+
+  // Per request, indexed by its first descriptor.
+  struct {
+    struct buf *b;
+    struct virtio_blk_req req;
+    uchar status;
+  } info[VQMAX];
+} vblk;
+
+// Find and set up a virtio block device.
+// Returns 1 if there is one, else 0.
+int
+virtioinit(void)
+{
+  struct pcidev *d;
+  uint asize, size;
+  int i, order;
+  char *q;
+
+  if((d = pcifind(VIRTIO_VENDOR, VIRTIO_BLK_DEVICE, -1, -1)) == 0)
+    return 0;
+  if(d->irq == 0 || d->irq >= 16){
+    cprintf("virtio: no irq\n");
+    return 0;
+  }
+  initlock(&vblk.lock, "virtio");
+  pcienable(d);
+  vblk.base = d->bar[0];
+
+  outb(vblk.base + VIRTIO_STATUS, 0);  // reset
+  outb(vblk.base + VIRTIO_STATUS, VIRTIO_S_ACK);
+  outb(vblk.base + VIRTIO_STATUS, VIRTIO_S_ACK|VIRTIO_S_DRIVER);
+  outl(vblk.base + VIRTIO_GFEATURES, 0);  // no optional features
+
+  outw(vblk.base + VIRTIO_QSEL, 0);
+  vblk.num = inw(vblk.base + VIRTIO_QSIZE);
+  if(vblk.num < 3 || vblk.num > VQMAX){
+    cprintf("virtio: queue size %d\n", vblk.num);
+    return 0;
+  }
+
+  // The descriptors and available ring, then the used ring
+  // on the next VRING_ALIGN boundary, in contiguous pages.
+  asize = PGROUNDUP(sizeof(struct vring_desc)*vblk.num +
+                    sizeof(struct vring_avail) + sizeof(ushort)*(vblk.num+1));
+  size = asize + PGROUNDUP(sizeof(struct vring_used) +
+                    sizeof(struct vring_used_elem)*vblk.num + sizeof(ushort));
+  for(order = 0; (PGSIZE << order) < size; order++)
+    ;
+  if((q = kallocpages(order)) == 0)
+    return 0;
+  memset(q, 0, PGSIZE << order);
+  vblk.desc = (struct vring_desc*)q;
+  vblk.avail = (struct vring_avail*)(q + sizeof(struct vring_desc)*vblk.num);
+  vblk.used = (struct vring_used*)(q + asize);
+  outl(vblk.base + VIRTIO_QPFN, v2p(q) / VRING_ALIGN);
+
+  for(i = 0; i < vblk.num; i++)
+    vblk.desc[i].next = i + 1;
+  vblk.freehead = 0;
+  vblk.nfree = vblk.num;
+
+  vblk.irq = d->irq;
+  picenable(vblk.irq);
+  ioapicenable(vblk.irq, ncpu - 1);
+  outb(vblk.base + VIRTIO_STATUS,
+       VIRTIO_S_ACK|VIRTIO_S_DRIVER|VIRTIO_S_DRIVEROK);
+  return 1;
+}
+
+// Take a free descriptor.  Caller holds vblk.lock.
+static ushort
+descalloc(void)
+{
+  ushort i;
+
+  i = vblk.freehead;
+  vblk.freehead = vblk.desc[i].next;
+  vblk.nfree--;
+  return i;
+}
+
+// Free the chain of descriptors starting at i.
+// Caller holds vblk.lock.
+static void
+descfree(ushort i)
+{
+  ushort next;
+  int more;
+
+  do {
+    more = vblk.desc[i].flags & VRING_DESC_F_NEXT;
+    next = vblk.desc[i].next;
+    vblk.desc[i].flags = 0;
+    vblk.desc[i].next = vblk.freehead;
+    vblk.freehead = i;
+    vblk.nfree++;
+    i = next;
+  } while(more);
+}
+
+// Tell the device about new requests.  Caller holds vblk.lock.
+static void
+notify(void)
+{
+  // The device may ask not to be told while it is busy.
+  if(!(vblk.used->flags & VRING_USED_F_NO_NOTIFY))
+    outw(vblk.base + VIRTIO_QNOTIFY, 0);
+}
+
+// Queue b for the disk and return without waiting; see idesubmit().
+void
+virtiosubmit(struct buf *b)
+{
+  ushort d0, d1, d2;
+
+  acquire(&vblk.lock);
+  while(vblk.nfree < 3){
+    // Let the device drain what is queued, even if plugged.
+    if(vblk.kick){
+      vblk.kick = 0;
+      notify();
+    }
+    sleep(&vblk.nfree, &vblk.lock);
+  }
+
+  d0 = descalloc();
+  d1 = descalloc();
+  d2 = descalloc();
+  vblk.info[d0].b = b;
+  vblk.info[d0].status = 0xff;
+  vblk.info[d0].req.type = (b->flags & B_DIRTY) ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+  vblk.info[d0].req.reserved = 0;
+  vblk.info[d0].req.sector = (uint64)b->blockno * (BSIZE/512);
+
+  vblk.desc[d0].addr = v2p(&vblk.info[d0].req);
+  vblk.desc[d0].len = sizeof(struct virtio_blk_req);
+  vblk.desc[d0].flags = VRING_DESC_F_NEXT;
+  vblk.desc[d0].next = d1;
+
+  vblk.desc[d1].addr = v2p(b->data);
+  vblk.desc[d1].len = BSIZE;
+  vblk.desc[d1].flags = VRING_DESC_F_NEXT;
+  if(!(b->flags & B_DIRTY))
+    vblk.desc[d1].flags |= VRING_DESC_F_WRITE;
+  vblk.desc[d1].next = d2;
+
+  vblk.desc[d2].addr = v2p(&vblk.info[d0].status);
+  vblk.desc[d2].len = 1;
+  vblk.desc[d2].flags = VRING_DESC_F_WRITE;
+
+  // Publish the chain, then the new index.
+  vblk.avail->ring[vblk.avail->idx % vblk.num] = d0;
+  __sync_synchronize();
+  vblk.avail->idx++;
+  __sync_synchronize();
+
+  if(vblk.plugged)
+    vblk.kick = 1;
+  else
+    notify();
+  release(&vblk.lock);
+}
+
+// Hold off telling the device about new requests until
+// virtiounplug(), so it sees them all at once.
+void
+virtioplug(void)
+{
+  acquire(&vblk.lock);
+  vblk.plugged++;
+  release(&vblk.lock);
+}
+
+void
+virtiounplug(void)
+{
+  acquire(&vblk.lock);
+  if(--vblk.plugged == 0 && vblk.kick){
+    vblk.kick = 0;
+    notify();
+  }
+  release(&vblk.lock);
+}
+
+// Wait for a request started by virtiosubmit() without a
+// done callback to finish.
+void
+virtioawait(struct buf *b)
+{
+  acquire(&vblk.lock);
+  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID)
+    sleep(b, &vblk.lock);
+  release(&vblk.lock);
+}
+
+// Interrupt handler.  Returns 0 if trapno is not our interrupt.
+int
+virtiointr(int trapno)
+{
+  struct buf *b, *cb, *next;
+  ushort id;
+
+  if(vblk.irq == 0 || trapno != T_IRQ0 + vblk.irq)
+    return 0;
+
+  acquire(&vblk.lock);
+  inb(vblk.base + VIRTIO_ISR);  // ack
+
+  // Finish every request the device has completed, and
+  // collect the bufs with completion callbacks on cb.
+  cb = 0;
+  while(vblk.lastused != *(volatile ushort*)&vblk.used->idx){
+    __sync_synchronize();
+    id = vblk.used->ring[vblk.lastused % vblk.num].id;
+    b = vblk.info[id].b;
+    if(vblk.info[id].status != 0)
+      cprintf("virtio: block %d: error %d\n", b->blockno, vblk.info[id].status);
+    vblk.info[id].b = 0;
+    descfree(id);
+    vblk.lastused++;
+
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if(b->done){
+      b->qnext = cb;
+      cb = b;
+    } else
+      wakeup(b);
+  }
+  wakeup(&vblk.nfree);
+  release(&vblk.lock);
+
+  // Completion callbacks run without vblk.lock, in interrupt
+  // context, so they must not sleep.
+  for(b = cb; b; b = next){
+    void (*done)(struct buf*) = b->done;
+    next = b->qnext;
+    b->done = 0;
+    done(b);
+  }
+  return 1;
+}
@@ -0,0 +1,58 @@
+// Legacy virtio over PCI, and the virtio block device.
+// See the Virtual I/O Device (VIRTIO) spec, "Legacy Interface".
+
+#define VIRTIO_VENDOR     0x1af4
+#define VIRTIO_BLK_DEVICE 0x1001
+
+// Registers, at I/O BAR 0.
+#define VIRTIO_FEATURES   0x00  // device features
+#define VIRTIO_GFEATURES  0x04  // features the driver accepts
+#define VIRTIO_QPFN       0x08  // queue address / 4096
+#define VIRTIO_QSIZE      0x0c  // 16 bits
+#define VIRTIO_QSEL       0x0e  // 16 bits
+#define VIRTIO_QNOTIFY    0x10  // 16 bits
+#define VIRTIO_STATUS     0x12  // 8 bits
+#define VIRTIO_ISR        0x13  // 8 bits; reading acks the interrupt
+
+// Status register bits.
+#define VIRTIO_S_ACK      1
+#define VIRTIO_S_DRIVER   2
+#define VIRTIO_S_DRIVEROK 4
+
+#define VRING_ALIGN       4096
+
+struct vring_desc {
+  uint64 addr;
+  uint len;
+  ushort flags;
+  ushort next;
+};
+#define VRING_DESC_F_NEXT  1  // chained with next
+#define VRING_DESC_F_WRITE 2  // device writes (vs reads)
+
+struct vring_avail {
+  ushort flags;
+  ushort idx;
+  ushort ring[];
+};
+
+struct vring_used_elem {
+  uint id;   // head of the finished descriptor chain
+  uint len;
+};
+
+struct vring_used {
+  ushort flags;
+  ushort idx;
+  struct vring_used_elem ring[];
+};
+#define VRING_USED_F_NO_NOTIFY 1
+
+// First descriptor of a block request.
+struct virtio_blk_req {
+  uint type;
+  uint reserved;
+  uint64 sector;
+};
+#define VIRTIO_BLK_T_IN   0  // read
+#define VIRTIO_BLK_T_OUT  1  // write
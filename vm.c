@@ -4,8 +4,10 @@
 #include "x86.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "elf.h"
+#include "traps.h"
 
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
@@ -39,23 +41,53 @@ seginit(void)
   proc = 0;
 }
 
+// Split the 4-Mbyte user page mapped by *pde into 4-Kbyte
+// pages, so that parts of it can be unmapped or remapped.
+// The physical pages stay where they are; the buddy allocator
+// lets them be freed one at a time.
+static int
+demote(pde_t *pde)
+{
+  pte_t *pgtab;
+  uint pa, flags;
+  int i;
+
+  if((pgtab = (pte_t*)kalloc()) == 0)
+    return -1;
+  pa = PTE_ADDR(*pde);
+  flags = PTE_FLAGS(*pde) & ~PTE_PS;
+  for(i = 0; i < NPTENTRIES; i++)
+    pgtab[i] = (pa + i*PGSIZE) | flags;
+  *pde = v2p(pgtab) | PTE_P | PTE_W | PTE_U;
+  return 0;
+}
+
 // Return the address of the PTE in page table pgdir
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page table pages.
-static pte_t *
+// If va lies in a superpage, a lookup (alloc==0) returns the
+// PDE itself, which callers recognise by PTE_PS.  With alloc!=0
+// a user superpage is demoted to 4-Kbyte pages first; kernel
+// superpages are shared by every pgdir and are never split.
+pte_t *
 walkpgdir(pde_t *pgdir, const void *va, int alloc)
 {
   pde_t *pde;
   pte_t *pgtab;
 
   pde = &pgdir[PDX(va)];
+  if(*pde & PTE_PS){
+    if(!alloc)
+      return (pte_t*)pde;
+    if(!(*pde & PTE_U) || demote(pde) < 0)
+      return 0;
+  }
   if(*pde & PTE_P){
     pgtab = (pte_t*)p2v(PTE_ADDR(*pde));
   } else {
-    if(!alloc || (pgtab = (pte_t*)kalloc()) == 0)
-      return 0;
     // Make sure all those PTE_P bits are zero.
-    memset(pgtab, 0, PGSIZE);
+    if(!alloc || (pgtab = (pte_t*)kzalloc()) == 0)
+      return 0;
     // The permissions here are overly generous, but they can
     // be further restricted by the permissions in the page table 
     // entries, if necessary.
@@ -67,7 +99,7 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
 // be page-aligned.
-static int
+int
 mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 {
   char *a, *last;
@@ -95,7 +127,8 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 // page protection bits prevent user code from using the kernel's
 // mappings.
 // 
-// setupkvm() and exec() set up every page table like this:
+// kvmalloc() builds kpgdir like this, and setupkvm() copies its
+// kernel half into every process's page directory:
 //
 //   0..KERNBASE: user memory (text+data+stack+heap), mapped to
 //                phys memory allocated by the kernel
@@ -106,6 +139,12 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 //                                  rw data + free physical memory
 //   0xfe000000..0: mapped direct (devices such as ioapic)
 //
+// Everything from the first 4-Mbyte boundary up is mapped with
+// PTE_PS superpages.  Only the first 4 Mbytes, which hold the
+// read-only kernel text, use a page table, and that one page
+// table is shared by all page directories.  So setupkvm() just
+// copies 256 directory entries and allocates nothing else.
+//
 // The kernel allocates physical memory for its heap and for user memory
 // between V2P(end) and the end of physical memory (PHYSTOP)
 // (directly addressable from end..P2V(PHYSTOP)).
@@ -124,22 +163,44 @@ static struct kmap {
  { (void*)DEVSPACE, DEVSPACE,      0,         PTE_W}, // more devices
 };
 
+// Map size bytes at va to pa in the kernel part of pgdir,
+// using superpages where va and pa are 4-Mbyte aligned.
+// Kernel mappings are the same in every address space, so
+// they are marked global and switchuvm() does not flush them.
+static int
+kvmmap(pde_t *pgdir, uint va, uint size, uint pa, int perm)
+{
+  uint n;
+
+  perm |= PTE_G;
+  while(size > 0){
+    if(va % SPGSIZE == 0 && pa % SPGSIZE == 0 && size >= SPGSIZE){
+      pgdir[PDX(va)] = pa | perm | PTE_P | PTE_PS;
+      n = SPGSIZE;
+    } else {
+      n = SPGSIZE - va % SPGSIZE;
+      if(n > size)
+        n = size;
+      if(mappages(pgdir, (void*)va, n, pa, perm) < 0)
+        return -1;
+    }
+    va += n;
+    pa += n;
+    size -= n;
+  }
+  return 0;
+}
+
 // Set up kernel part of a page table.
 pde_t*
 setupkvm(void)
 {
   pde_t *pgdir;
-  struct kmap *k;
 
-  if((pgdir = (pde_t*)kalloc()) == 0)
+  if((pgdir = (pde_t*)kzalloc()) == 0)
     return 0;
-  memset(pgdir, 0, PGSIZE);
-  if (p2v(PHYSTOP) > (void*)DEVSPACE)
-    panic("PHYSTOP too high");
-  for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
-    if(mappages(pgdir, k->virt, k->phys_end - k->phys_start, 
-                (uint)k->phys_start, k->perm) < 0)
-      return 0;
+  memmove(&pgdir[PDX(KERNBASE)], &kpgdir[PDX(KERNBASE)],
+          (NPDENTRIES - PDX(KERNBASE)) * sizeof(pde_t));
   return pgdir;
 }
 
@@ -148,7 +209,16 @@ setupkvm(void)
 void
 kvmalloc(void)
 {
-  kpgdir = setupkvm();
+  struct kmap *k;
+
+  if((kpgdir = (pde_t*)kzalloc()) == 0)
+    panic("kvmalloc");
+  if (p2v(PHYSTOP) > (void*)DEVSPACE)
+    panic("PHYSTOP too high");
+  for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
+    if(kvmmap(kpgdir, (uint)k->virt, k->phys_end - k->phys_start, 
+              (uint)k->phys_start, k->perm) < 0)
+      panic("kvmalloc");
   switchkvm();
 }
 
@@ -172,10 +242,53 @@ switchuvm(struct proc *p)
   ltr(SEG_TSS << 3);
   if(p->pgdir == 0)
     panic("switchuvm: no pgdir");
-  lcr3(v2p(p->pgdir));  // switch to new address space
+  lcr3(v2p(p->pgdir));  // switch to new address space; global
+                        // kernel TLB entries stay loaded
   popcli();
 }
 
+// Make every other CPU running a thread of the current process
+// flush its TLB, and wait until they all have.  Caller must not
+// hold a spinlock, which a CPU we wait for might be spinning on
+// with interrupts off.
+void
+tlbshootdown(void)
+{
+  struct cpu *c;
+  struct proc *p;
+
+  pushcli();
+  __sync_synchronize();  // PTE changes before looking at the CPUs
+  for(c = cpus; c < cpus+ncpu; c++){
+    p = c->proc;
+    if(c == cpu || p == 0 || p->leader != proc->leader)
+      continue;
+    c->tlbflush = 1;
+    lapicipi(c->id, T_TLBFLUSH);
+  }
+  for(c = cpus; c < cpus+ncpu; c++)
+    while(c->tlbflush)
+      ;
+  popcli();
+}
+
+// Free the 2^order pages at v, which were mapped at va in pgdir
+// until just now.  If pgdir is the current process's, its other
+// threads may be running, and no CPU may keep the old mapping
+// in its TLB once the pages are free.
+void
+unmapfree(pde_t *pgdir, uint va, char *v, int order)
+{
+  if(proc && pgdir == proc->pgdir){
+    invlpg((void*)va);
+    tlbshootdown();
+  }
+  if(order == 0)
+    kput(v);
+  else
+    kfreepages(v, order);
+}
+
 // Load the initcode into address 0 of pgdir.
 // sz must be less than a page.
 void
@@ -185,8 +298,7 @@ inituvm(pde_t *pgdir, char *init, uint sz)
   
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kzalloc();
   mappages(pgdir, 0, PGSIZE, v2p(mem), PTE_W|PTE_U);
   memmove(mem, init, sz);
 }
@@ -216,9 +328,12 @@ loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
 }
 
 // Allocate page tables and physical memory to grow process from oldsz to
-// newsz, which need not be page aligned.  Returns new size or 0 on error.
-int
-allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
+// newsz, which need not be page aligned.  If super is set, each
+// 4-Mbyte aligned stretch is backed by one superpage when the
+// buddy allocator has a free 4-Mbyte block.
+// Returns new size or 0 on error.
+static int
+uvmgrow(pde_t *pgdir, uint oldsz, uint newsz, int super)
 {
   char *mem;
   uint a;
@@ -229,51 +344,107 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
     return oldsz;
 
   a = PGROUNDUP(oldsz);
-  for(; a < newsz; a += PGSIZE){
-    mem = kalloc();
-    if(mem == 0){
-      cprintf("allocuvm out of memory\n");
-      deallocuvm(pgdir, newsz, oldsz);
-      return 0;
+  while(a < newsz){
+    if(super && a % SPGSIZE == 0 && newsz - a >= SPGSIZE &&
+       pgdir[PDX(a)] == 0 && (mem = kallocpages(SPGORDER)) != 0){
+      memset(mem, 0, SPGSIZE);
+      pgdir[PDX(a)] = v2p(mem) | PTE_P | PTE_W | PTE_U | PTE_PS;
+      a += SPGSIZE;
+      continue;
     }
-    memset(mem, 0, PGSIZE);
-    mappages(pgdir, (char*)a, PGSIZE, v2p(mem), PTE_W|PTE_U);
+    if(!(pgdir[PDX(a)] & PTE_P)){
+      // The page table may need room made by swapping too.
+      if((mem = ualloc()) == 0)
+        goto bad;
+      pgdir[PDX(a)] = v2p(mem) | PTE_P | PTE_W | PTE_U;
+    }
+    mem = ualloc();
+    if(mem == 0)
+      goto bad;
+    if(mappages(pgdir, (char*)a, PGSIZE, v2p(mem), PTE_W|PTE_U) < 0){
+      kfree(mem);
+      goto bad;
+    }
+    a += PGSIZE;
   }
   return newsz;
+
+bad:
+  cprintf("allocuvm out of memory\n");
+  deallocuvm(pgdir, newsz, oldsz);
+  return 0;
+}
+
+int
+allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
+{
+  return uvmgrow(pgdir, oldsz, newsz, 0);
+}
+
+// Like allocuvm, but for heap growth, which may use superpages.
+int
+growuvm(pde_t *pgdir, uint oldsz, uint newsz)
+{
+  return uvmgrow(pgdir, oldsz, newsz, HEAPSUPERPAGES);
 }
 
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size, which is rounded
+// up to the end of a superpage that could not be split.
 int
 deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 {
+  pde_t *pde;
   pte_t *pte;
-  uint a, pa;
+  uint a, pa, shared;
 
   if(newsz >= oldsz)
     return oldsz;
 
   a = PGROUNDUP(newsz);
   for(; a  < oldsz; a += PGSIZE){
+    pde = &pgdir[PDX(a)];
+    if(*pde & PTE_PS){
+      if(a % SPGSIZE == 0 && oldsz - a >= SPGSIZE){
+        // Whole superpage goes.
+        pa = PTE_ADDR(*pde);
+        *pde = 0;
+        unmapfree(pgdir, a, p2v(pa), SPGORDER);
+        a += SPGSIZE - PGSIZE;
+        continue;
+      }
+      if(demote(pde) < 0){
+        // Can't split it: keep the whole superpage, which
+        // only happens for the one holding the new end.
+        a = a - a % SPGSIZE + SPGSIZE - PGSIZE;
+        newsz = a + PGSIZE;
+        continue;
+      }
+    }
     pte = walkpgdir(pgdir, (char*)a, 0);
     if(!pte)
       a += (NPTENTRIES - 1) * PGSIZE;
-    else if((*pte & PTE_P) != 0){
+    else if(*pte & PTE_SWAPPED){
+      swapfree(*pte);
+      *pte = 0;
+    } else if((*pte & PTE_P) != 0){
       pa = PTE_ADDR(*pte);
       if(pa == 0)
         panic("kfree");
-      char *v = p2v(pa);
-      kfree(v);
+      shared = *pte & PTE_SHARED;
       *pte = 0;
+      if(!shared)  // shm.c owns shared pages
+        unmapfree(pgdir, a, p2v(pa), 0);
     }
   }
   return newsz;
 }
 
 // Free a page table and all the physical memory pages
-// in the user part.
+// in the user part.  The kernel part is shared with
+// kpgdir and is left alone.
 void
 freevm(pde_t *pgdir)
 {
@@ -282,7 +453,7 @@ freevm(pde_t *pgdir)
   if(pgdir == 0)
     panic("freevm: no pgdir");
   deallocuvm(pgdir, KERNBASE, 0);
-  for(i = 0; i < NPDENTRIES; i++){
+  for(i = 0; i < PDX(KERNBASE); i++){
     if(pgdir[i] & PTE_P){
       char * v = p2v(PTE_ADDR(pgdir[i]));
       kfree(v);
@@ -309,7 +480,7 @@ clearpteu(pde_t *pgdir, char *uva)
 pde_t*
 copyuvm(pde_t *pgdir, uint sz)
 {
-  pde_t *d;
+  pde_t *d, *pde;
   pte_t *pte;
   uint pa, i, flags;
   char *mem;
@@ -317,13 +488,37 @@ copyuvm(pde_t *pgdir, uint sz)
   if((d = setupkvm()) == 0)
     return 0;
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
-    if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
-    pa = PTE_ADDR(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    pde = &pgdir[PDX(i)];
+    if(*pde & PTE_PS){
+      // Copy a superpage whole if a 4-Mbyte block is free,
+      // and as 4-Kbyte pages otherwise.
+      if(i % SPGSIZE == 0 && (mem = kallocpages(SPGORDER)) != 0){
+        memmove(mem, (char*)p2v(PTE_ADDR(*pde)), SPGSIZE);
+        d[PDX(i)] = v2p(mem) | PTE_FLAGS(*pde);
+        i += SPGSIZE - PGSIZE;
+        continue;
+      }
+      pa = PTE_ADDR(*pde) + i % SPGSIZE;
+      flags = PTE_FLAGS(*pde) & ~PTE_PS;
+    } else {
+      if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
+        panic("copyuvm: pte should exist");
+      if(*pte & PTE_SWAPPED){
+        // Read the child's copy straight from swap.
+        if((mem = ualloc()) == 0)
+          goto bad;
+        swapread(*pte, mem);
+        flags = PTE_FLAGS(*pte) & ~PTE_SWAPPED;
+        if(mappages(d, (void*)i, PGSIZE, v2p(mem), flags) < 0)
+          goto bad;
+        continue;
+      }
+      if(!(*pte & PTE_P))
+        panic("copyuvm: page not present");
+      pa = PTE_ADDR(*pte);
+      flags = PTE_FLAGS(*pte);
+    }
+    if((mem = ualloc()) == 0)
       goto bad;
     memmove(mem, (char*)p2v(pa), PGSIZE);
     if(mappages(d, (void*)i, PGSIZE, v2p(mem), flags) < 0)
@@ -341,9 +536,15 @@ bad:
 char*
 uva2ka(pde_t *pgdir, char *uva)
 {
+  pde_t *pde;
   pte_t *pte;
 
+  pde = &pgdir[PDX(uva)];
+  if((*pde & (PTE_P|PTE_U|PTE_PS)) == (PTE_P|PTE_U|PTE_PS))
+    return (char*)p2v(PTE_ADDR(*pde) + PGROUNDDOWN((uint)uva % SPGSIZE));
   pte = walkpgdir(pgdir, uva, 0);
+  if(pte == 0)
+    return 0;
   if((*pte & PTE_P) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
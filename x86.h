@@ -9,6 +9,24 @@ inb(ushort port)
   return data;
 }
 
+static inline ushort
+inw(ushort port)
+{
+  ushort data;
+
+  asm volatile("in %1,%0" : "=a" (data) : "d" (port));
+  return data;
+}
+
+static inline uint
+inl(ushort port)
+{
+  uint data;
+
+  asm volatile("in %1,%0" : "=a" (data) : "d" (port));
+  return data;
+}
+
 static inline void
 insl(int port, void *addr, int cnt)
 {
@@ -30,6 +48,12 @@ outw(ushort port, ushort data)
   asm volatile("out %0,%1" : : "a" (data), "d" (port));
 }
 
+static inline void
+outl(ushort port, uint data)
+{
+  asm volatile("out %0,%1" : : "a" (data), "d" (port));
+}
+
 static inline void
 outsl(int port, const void *addr, int cnt)
 {
@@ -57,6 +81,43 @@ stosl(void *addr, int data, int cnt)
                "memory", "cc");
 }
 
+// Copy cnt bytes or words upward from src to dst.
+static inline void
+movsb(void *dst, const void *src, int cnt)
+{
+  asm volatile("cld; rep movsb" :
+               "=D" (dst), "=S" (src), "=c" (cnt) :
+               "0" (dst), "1" (src), "2" (cnt) :
+               "memory", "cc");
+}
+
+static inline void
+movsl(void *dst, const void *src, int cnt)
+{
+  asm volatile("cld; rep movsl" :
+               "=D" (dst), "=S" (src), "=c" (cnt) :
+               "0" (dst), "1" (src), "2" (cnt) :
+               "memory", "cc");
+}
+
+// Copy cnt words downward, starting with the words at dst and src.
+static inline void
+movslback(void *dst, const void *src, int cnt)
+{
+  asm volatile("std; rep movsl; cld" :
+               "=D" (dst), "=S" (src), "=c" (cnt) :
+               "0" (dst), "1" (src), "2" (cnt) :
+               "memory", "cc");
+}
+
+static inline uint64
+rdtsc(void)
+{
+  uint64 val;
+  asm volatile("rdtsc" : "=A" (val));
+  return val;
+}
+
 struct segdesc;
 
 static inline void
@@ -130,6 +191,20 @@ xchg(volatile uint *addr, uint newval)
   return result;
 }
 
+// Atomically set *addr to newval if it holds old.
+// Returns the value *addr held before.
+static inline uint
+cmpxchg(volatile uint *addr, uint old, uint newval)
+{
+  uint prev;
+
+  asm volatile("lock; cmpxchgl %2, %1" :
+               "=a" (prev), "+m" (*addr) :
+               "r" (newval), "0" (old) :
+               "cc");
+  return prev;
+}
+
 static inline uint
 rcr2(void)
 {
@@ -144,6 +219,94 @@ lcr3(uint val)
   asm volatile("movl %0,%%cr3" : : "r" (val));
 }
 
+static inline uint
+rcr3(void)
+{
+  uint val;
+  asm volatile("movl %%cr3,%0" : "=r" (val));
+  return val;
+}
+
+static inline void
+invlpg(void *addr)
+{
+  asm volatile("invlpg (%0)" : : "r" (addr) : "memory");
+}
+
+static inline uint
+rcr0(void)
+{
+  uint val;
+  asm volatile("movl %%cr0,%0" : "=r" (val));
+  return val;
+}
+
+static inline void
+lcr0(uint val)
+{
+  asm volatile("movl %0,%%cr0" : : "r" (val));
+}
+
+static inline uint
+rcr4(void)
+{
+  uint val;
+  asm volatile("movl %%cr4,%0" : "=r" (val));
+  return val;
+}
+
+static inline void
+lcr4(uint val)
+{
+  asm volatile("movl %0,%%cr4" : : "r" (val));
+}
+
+static inline void
+cpuid(uint info, uint *eaxp, uint *ebxp, uint *ecxp, uint *edxp)
+{
+  uint eax, ebx, ecx, edx;
+
+  asm volatile("cpuid" :
+               "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) :
+               "a" (info), "c" (0));
+  *eaxp = eax;
+  *ebxp = ebx;
+  *ecxp = ecx;
+  *edxp = edx;
+}
+
+// Clear CR0.TS so FPU instructions no longer trap.
+static inline void
+clts(void)
+{
+  asm volatile("clts");
+}
+
+static inline void
+fninit(void)
+{
+  asm volatile("fninit");
+}
+
+static inline void
+ldmxcsr(uint val)
+{
+  asm volatile("ldmxcsr %0" : : "m" (val));
+}
+
+// addr must be 16-byte aligned and 512 bytes long.
+static inline void
+fxsave(void *addr)
+{
+  asm volatile("fxsave %0" : "=m" (*(uchar(*)[512])addr));
+}
+
+static inline void
+fxrstor(void *addr)
+{
+  asm volatile("fxrstor %0" : : "m" (*(uchar(*)[512])addr));
+}
+
 //PAGEBREAK: 36
 // Layout of the trap frame built on the stack by the
 // hardware and by trapasm.S, and passed to trap().